@@ -69,15 +69,20 @@ int main(int argc, char *argv[])
 	if (argc != optind)
 		usage(1);
 
+	ugci_set_backend(UGCI_BACKEND_HIDDEV);
+
 	rd = ugci_init(NULL, UGCI_EVENT_WD, raw ? 0 : 1);
 
 	if (!raw)
 		printf("Detected %d UGCI device%s\n", rd, rd == 1 ? "" : "s");
 
-	if (!rd)
-		exit(0);
+	if (rd <= 0)
+		exit(rd ? 1 : 0);
 
-	ugci_get_eeprom(id, eeprom, &eeprom_len);
+	if (ugci_get_eeprom(id, eeprom, &eeprom_len)) {
+		fprintf(stderr, "UGCI(%d): Could not read the eeprom\n", id);
+		exit(1);
+	}
 
 	/* Standard binary output */
 	if (raw) {
@@ -88,12 +88,14 @@ int main(int argc, char *argv[])
 	memset(vals, ' ', UGCI_SEC_VALUES);
 	memcpy(vals, argv[optind], strlen(argv[optind]));
 
+	ugci_set_backend(UGCI_BACKEND_HIDDEV);
+
 	rd = ugci_init(NULL, 0, 1);
 
 	printf("Detected %d UGCI device%s\n", rd, rd == 1 ? "" : "s");
 
-	if (!rd)
-		exit(0);
+	if (rd <= 0)
+		exit(rd ? 1 : 0);
 
 	print_secblk(id, "New Block", vals);
 
@@ -33,26 +33,31 @@ static void mycallback(int id, enum ugci_event_type type, int value)
 static void usage(int exitval) __attribute__((__noreturn__));
 static void usage(int exitval)
 {
-	fprintf(exitval ? stderr : stdout, "Usage: testugci [--help] [--simul]\n");
+	fprintf(exitval ? stderr : stdout, "Usage: testugci [--help] [--simul] [--hidraw]\n");
 	exit(exitval);
 }
 
 int main(int argc, char *argv[])
 {
-	int i, rd, simul = 0;
+	int i, rd, simul = 0, backend = UGCI_BACKEND_HIDDEV;
 	unsigned char vals[UGCI_SEC_VALUES + 1];
 
-	if (argc > 1) {
-		if (argc > 2 || strcmp(argv[1], "--help") == 0)
-			usage(argc > 2 ? 1 : 0);
-		else if (strcmp(argv[1], "--simul") == 0)
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--help") == 0)
+			usage(0);
+		else if (strcmp(argv[i], "--simul") == 0)
 			simul = 1;
+		else if (strcmp(argv[i], "--hidraw") == 0)
+			backend = UGCI_BACKEND_HIDRAW;
 		else
 			usage(1);
 	}
-	
+
+	ugci_set_backend(backend);
+
 	rd = ugci_init(mycallback, UGCI_EVENT_MASK_COIN |
-		       UGCI_EVENT_MASK_PLAY, 1);
+		       UGCI_EVENT_MASK_PLAY | UGCI_EVENT_MASK_AXIS |
+		       UGCI_EVENT_MASK_BUTTON, 1);
 
 	printf("Detected %d UGCI device%s\n", rd, rd == 1 ? "" : "s");
 
@@ -0,0 +1,521 @@
+/*
+ * Copyright (C) 2006 Ben Collins <bcollins@ubuntu.com>
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/* The event bus, see ugci_publish(). One process owns the boards and
+ * writes every event it hands out into a ring in shared memory. Any
+ * number of other processes map the same ring and read it at their own
+ * pace, each keeping its own place in it, so the writer never waits for
+ * them and never knows how many there are. A reader that falls a whole
+ * ring behind loses the oldest events.
+ *
+ * Each slot has a sequence number, odd while it is being written and
+ * then even, so a reader can tell that a slot was overwritten while it
+ * was copying it. Readers only make a syscall when there is nothing to
+ * read and they want to wait, which is a futex on the low bits of the
+ * tail. The writer only wakes them if one says it is waiting.
+ *
+ * A reader that wants an fd for its own event loop gets an eventfd, and a
+ * thread that sleeps on the futex for it and makes the eventfd readable
+ * whenever the tail moves. That costs the writer a wake for each batch,
+ * so it is only started by ugci_get_fd(). */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <pthread.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <stdint.h>
+
+#include <linux/types.h>
+#include <linux/hiddev.h>
+#include <linux/futex.h>
+
+#include "ugci.h"
+#include "ugci-private.h"
+
+#define UGCI_BUS_MAGIC		0x55474349	/* "UGCI" */
+#define UGCI_BUS_VERSION	1
+#define UGCI_BUS_SIZE		4096
+
+/* How often a waiting reader checks that the writer is still there */
+#define UGCI_BUS_CHECK_MS	1000
+
+struct ugci_bus_slot {
+	unsigned long long seq;
+	struct ugci_event ev;
+};
+
+struct ugci_bus {
+	unsigned int magic;
+	unsigned int version;
+	unsigned int size;		/* Slots, a power of 2 */
+	unsigned int boards;		/* When it was published */
+	pid_t pid;			/* Of the writer */
+	int closed;			/* The writer has stopped */
+
+	unsigned int wake;		/* Futex, the low bits of tail */
+	unsigned int waiters;		/* Readers sleeping on it */
+	unsigned long long tail;	/* Events ever written */
+
+	struct ugci_bus_slot slot[];
+};
+
+static inline size_t ugci_bus_len(unsigned int size)
+{
+	return sizeof(struct ugci_bus) + size * sizeof(struct ugci_bus_slot);
+}
+
+static int ugci_futex(unsigned int *addr, int op, unsigned int val,
+		      const struct timespec *timeout)
+{
+	return syscall(SYS_futex, addr, op, val, timeout, NULL, 0);
+}
+
+/* Wakes anyone waiting. Only ever called from the writer. */
+static void ugci_bus_wake(struct ugci_bus *bus)
+{
+	__atomic_store_n(&bus->wake, (unsigned int)bus->tail, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&bus->waiters, __ATOMIC_SEQ_CST))
+		ugci_futex(&bus->wake, FUTEX_WAKE, INT_MAX, NULL);
+}
+
+/* Called with the poll lock held */
+void ugci_bus_publish(struct ugci_ctx *ctx, const struct ugci_event *ev, int count)
+{
+	struct ugci_bus *bus = ctx->bus_out;
+	unsigned long long tail = bus->tail;
+	struct ugci_bus_slot *slot;
+	int i;
+
+	for (i = 0; i < count; i++, tail++) {
+		slot = &bus->slot[tail & (bus->size - 1)];
+
+		__atomic_store_n(&slot->seq, tail * 2 + 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+		slot->ev = ev[i];
+		__atomic_store_n(&slot->seq, tail * 2 + 2, __ATOMIC_RELEASE);
+	}
+
+	__atomic_store_n(&bus->tail, tail, __ATOMIC_RELEASE);
+
+	ugci_bus_wake(bus);
+}
+
+/* The writer may have been killed without a chance to close it */
+static int ugci_bus_alive(struct ugci_bus *bus)
+{
+	if (__atomic_load_n(&bus->closed, __ATOMIC_ACQUIRE))
+		return 0;
+
+	return kill(bus->pid, 0) == 0 || errno == EPERM;
+}
+
+/* After a reader's wait timed out. If the writer died, we close it for
+ * it, so the other readers find out straight away. */
+static void ugci_bus_check(struct ugci_bus *bus)
+{
+	if (__atomic_load_n(&bus->closed, __ATOMIC_ACQUIRE) || ugci_bus_alive(bus))
+		return;
+
+	__atomic_store_n(&bus->closed, 1, __ATOMIC_RELEASE);
+	ugci_futex(&bus->wake, FUTEX_WAKE, INT_MAX, NULL);
+}
+
+/* Map an existing bus. The writer needs to write its half, and readers
+ * need to say they are waiting, so both map it writable. */
+static struct ugci_bus *ugci_bus_map(const char *name, int quiet)
+{
+	struct ugci_bus *bus;
+	struct stat st;
+	int fd;
+
+	if ((fd = shm_open(name, O_RDWR | O_CLOEXEC, 0)) < 0)
+		return NULL;
+
+	if (fstat(fd, &st) || st.st_size < sizeof(*bus)) {
+		close(fd);
+		return NULL;
+	}
+
+	bus = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (bus == MAP_FAILED)
+		return NULL;
+
+	if (__atomic_load_n(&bus->magic, __ATOMIC_ACQUIRE) != UGCI_BUS_MAGIC ||
+	    bus->version != UGCI_BUS_VERSION ||
+	    st.st_size < ugci_bus_len(bus->size)) {
+		if (!quiet)
+			fprintf(stderr, "UGCI: %s is not a usable event bus\n", name);
+		munmap(bus, st.st_size);
+		return NULL;
+	}
+
+	return bus;
+}
+
+static void ugci_bus_unpublish(struct ugci_ctx *ctx)
+{
+	struct ugci_bus *bus = ctx->bus_out;
+
+	if (!bus)
+		return;
+
+	/* Anyone still attached sees it closed, and the name is free for
+	 * the next one */
+	__atomic_store_n(&bus->closed, 1, __ATOMIC_RELEASE);
+	ugci_bus_wake(bus);
+
+	shm_unlink(ctx->bus_name);
+	munmap(bus, ugci_bus_len(bus->size));
+
+	free(ctx->bus_name);
+	ctx->bus_name = NULL;
+	ctx->bus_out = NULL;
+}
+
+int ugci_ctx_publish(struct ugci_ctx *ctx, const char *name, int size)
+{
+	unsigned int slots = 64;
+	struct ugci_bus *bus;
+	int fd, ret = -1;
+
+	pthread_mutex_lock(&ctx->poll_lock);
+
+	ugci_bus_unpublish(ctx);
+
+	if (!name) {
+		ret = 0;
+		goto out;
+	}
+
+	if (size < 0 || ! ctx->initialized || ctx->bus)
+		goto out;
+
+	while (slots < (size ?: UGCI_BUS_SIZE))
+		slots <<= 1;
+
+	/* Left behind by one that did not shut down */
+	if ((bus = ugci_bus_map(name, 0)) != NULL) {
+		if (ugci_bus_alive(bus)) {
+			munmap(bus, ugci_bus_len(bus->size));
+			if (ctx->info_out)
+				printf("UGCI: %s is already being published\n", name);
+			goto out;
+		}
+		munmap(bus, ugci_bus_len(bus->size));
+		shm_unlink(name);
+	}
+
+	if ((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0660)) < 0)
+		goto out;
+
+	/* Readers need to write too, to say they are waiting. The umask
+	 * would otherwise keep the group out. */
+	if (fchmod(fd, 0660) || ftruncate(fd, ugci_bus_len(slots))) {
+		close(fd);
+		shm_unlink(name);
+		goto out;
+	}
+
+	bus = mmap(NULL, ugci_bus_len(slots), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (bus == MAP_FAILED || !(ctx->bus_name = strdup(name))) {
+		if (bus != MAP_FAILED)
+			munmap(bus, ugci_bus_len(slots));
+		shm_unlink(name);
+		goto out;
+	}
+
+	bus->size = slots;
+	bus->boards = ctx->active;
+	bus->pid = getpid();
+	bus->version = UGCI_BUS_VERSION;
+	__atomic_store_n(&bus->magic, UGCI_BUS_MAGIC, __ATOMIC_RELEASE);
+
+	ctx->bus_out = bus;
+	ret = 0;
+
+	if (ctx->info_out)
+		printf("UGCI: Publishing events on %s, %u slots\n", name, slots);
+
+out:
+	pthread_mutex_unlock(&ctx->poll_lock);
+
+	return ret;
+}
+
+/* Returns the number of boards, or less than zero if there is no bus or
+ * nobody is writing to it */
+int ugci_bus_attach(struct ugci_ctx *ctx, const char *name, int quiet)
+{
+	struct ugci_bus *bus;
+
+	if (!(bus = ugci_bus_map(name, quiet)))
+		return -1;
+
+	if (!ugci_bus_alive(bus)) {
+		munmap(bus, ugci_bus_len(bus->size));
+		return -1;
+	}
+
+	/* Only what is published from now on */
+	ctx->bus = bus;
+	ctx->bus_head = __atomic_load_n(&bus->tail, __ATOMIC_ACQUIRE);
+
+	if (ctx->info_out)
+		printf("UGCI: Attached to the event bus on %s, %u device%s\n",
+		       name, bus->boards, bus->boards == 1 ? "" : "s");
+
+	return bus->boards;
+}
+
+/* Called with the poll lock held */
+void ugci_bus_detach(struct ugci_ctx *ctx)
+{
+	/* Changing the futex word means the thread can't go to sleep after
+	 * it looked at the stop flag. Everyone else waiting on the bus just
+	 * sees a spurious wake. */
+	if (ctx->bus_fd >= 0) {
+		__atomic_store_n(&ctx->bus_notify_stop, 1, __ATOMIC_SEQ_CST);
+		__atomic_add_fetch(&ctx->bus->wake, 1, __ATOMIC_SEQ_CST);
+		ugci_futex(&ctx->bus->wake, FUTEX_WAKE, INT_MAX, NULL);
+		pthread_join(ctx->bus_thread, NULL);
+
+		close(ctx->bus_fd);
+		ctx->bus_fd = -1;
+	}
+
+	if (ctx->bus) {
+		munmap(ctx->bus, ugci_bus_len(ctx->bus->size));
+		ctx->bus = NULL;
+	}
+}
+
+static int ugci_bus_wanted(struct ugci_ctx *ctx, enum ugci_event_type type)
+{
+	switch (type) {
+		case UGCI_EVENT_COIN:
+			return ctx->event_mask & UGCI_EVENT_MASK_COIN;
+		case UGCI_EVENT_PLAY:
+			return ctx->event_mask & UGCI_EVENT_MASK_PLAY;
+		case UGCI_EVENT_DEVICE:
+			return ctx->event_mask & UGCI_EVENT_MASK_DEVICE;
+		case UGCI_EVENT_AXIS_X:
+		case UGCI_EVENT_AXIS_Y:
+			return ctx->event_mask & UGCI_EVENT_MASK_AXIS;
+		case UGCI_EVENT_BUTTON_1 ... UGCI_EVENT_BUTTON_7:
+			return ctx->event_mask & UGCI_EVENT_MASK_BUTTON;
+		default:
+			return 0;
+	}
+}
+
+/* Never waits. Only events in our own mask are kept. */
+static int ugci_bus_read(struct ugci_ctx *ctx, struct ugci_event *out, int max)
+{
+	struct ugci_bus *bus = ctx->bus;
+	unsigned long long head = ctx->bus_head, seq;
+	unsigned long long tail = __atomic_load_n(&bus->tail, __ATOMIC_ACQUIRE);
+	struct ugci_bus_slot *slot;
+	int n = 0;
+
+	while (n < max && head != tail) {
+		slot = &bus->slot[head & (bus->size - 1)];
+
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		out[n] = slot->ev;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+		/* We are a whole ring behind, and it has been (or is being)
+		 * written over. Skip to half a ring behind, which leaves some
+		 * room before it catches up with us again. */
+		if (seq != head * 2 + 2 ||
+		    __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq) {
+			tail = __atomic_load_n(&bus->tail, __ATOMIC_ACQUIRE);
+			DPRINT("UGCI: Lost %llu events on the bus\n",
+			       tail - bus->size / 2 - head);
+			head = tail - bus->size / 2;
+			continue;
+		}
+
+		head++;
+		if (ugci_bus_wanted(ctx, out[n].type))
+			n++;
+	}
+
+	ctx->bus_head = head;
+
+	return n;
+}
+
+int ugci_bus_pending(struct ugci_ctx *ctx)
+{
+	return __atomic_load_n(&ctx->bus->tail, __ATOMIC_ACQUIRE) != ctx->bus_head;
+}
+
+static void ugci_bus_notify(struct ugci_ctx *ctx)
+{
+	uint64_t one = 1;
+
+	if (write(ctx->bus_fd, &one, sizeof(one)) < 0)
+		DPRINT("UGCI: Bus eventfd write failed\n");
+}
+
+/* Called with the poll lock held. Returns less than zero once the writer
+ * has gone and everything it wrote has been read. */
+int ugci_bus_events(struct ugci_ctx *ctx, struct ugci_event *out, int max, int timeout)
+{
+	struct ugci_bus *bus = ctx->bus;
+	unsigned long long now, end = 0;
+	struct timespec ts;
+	unsigned int wake;
+	uint64_t cnt;
+	int n, wait, closed = 0;
+
+	/* Cleared before we look, so nothing written after is missed */
+	if (ctx->bus_fd >= 0 && read(ctx->bus_fd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN)
+		DPRINT("UGCI: Bus eventfd read failed\n");
+
+	if ((n = ugci_bus_read(ctx, out, max)))
+		goto out;
+
+	if (!timeout) {
+		closed = __atomic_load_n(&bus->closed, __ATOMIC_ACQUIRE);
+		goto done;
+	}
+
+	if (timeout > 0)
+		end = ugci_now() + timeout * 1000000ULL;
+
+	/* Either the writer sees us waiting, or we see what it wrote, or
+	 * the futex word has changed and the wait returns right away */
+	__atomic_add_fetch(&bus->waiters, 1, __ATOMIC_SEQ_CST);
+
+	while (1) {
+		wake = __atomic_load_n(&bus->wake, __ATOMIC_SEQ_CST);
+
+		if ((n = ugci_bus_read(ctx, out, max)))
+			break;
+		if ((closed = __atomic_load_n(&bus->closed, __ATOMIC_ACQUIRE)))
+			break;
+
+		wait = UGCI_BUS_CHECK_MS;
+		if (timeout > 0) {
+			if ((now = ugci_now()) >= end)
+				break;
+			if (end - now < wait * 1000000ULL)
+				wait = (end - now + 999999) / 1000000;
+		}
+
+		ts.tv_sec = wait / 1000;
+		ts.tv_nsec = (wait % 1000) * 1000000;
+
+		/* Even asked to wait forever, we wake up now and then to
+		 * see if the writer died */
+		if (ugci_futex(&bus->wake, FUTEX_WAIT, wake, &ts) && errno == ETIMEDOUT)
+			ugci_bus_check(bus);
+	}
+
+	__atomic_sub_fetch(&bus->waiters, 1, __ATOMIC_SEQ_CST);
+
+done:
+	if (closed && ! ugci_bus_pending(ctx))
+		return -1;
+
+out:
+	/* There was more than would fit, so the fd stays readable */
+	if (ctx->bus_fd >= 0 && ugci_bus_pending(ctx))
+		ugci_bus_notify(ctx);
+
+	return n;
+}
+
+static void *ugci_bus_notify_main(void *arg)
+{
+	struct ugci_ctx *ctx = arg;
+	struct ugci_bus *bus = ctx->bus;
+	unsigned long long seen = ctx->bus_seen, tail;
+	struct timespec ts = {
+		.tv_sec = UGCI_BUS_CHECK_MS / 1000,
+		.tv_nsec = (UGCI_BUS_CHECK_MS % 1000) * 1000000,
+	};
+	unsigned int wake;
+
+	__atomic_add_fetch(&bus->waiters, 1, __ATOMIC_SEQ_CST);
+
+	while (! __atomic_load_n(&ctx->bus_notify_stop, __ATOMIC_ACQUIRE)) {
+		wake = __atomic_load_n(&bus->wake, __ATOMIC_SEQ_CST);
+		tail = __atomic_load_n(&bus->tail, __ATOMIC_ACQUIRE);
+
+		/* Once it is closed the fd just stays readable, and the
+		 * dispatch that follows finds out */
+		if (tail != seen || __atomic_load_n(&bus->closed, __ATOMIC_ACQUIRE)) {
+			seen = tail;
+			ugci_bus_notify(ctx);
+			if (__atomic_load_n(&bus->closed, __ATOMIC_ACQUIRE))
+				break;
+			continue;
+		}
+
+		if (ugci_futex(&bus->wake, FUTEX_WAIT, wake, &ts) && errno == ETIMEDOUT)
+			ugci_bus_check(bus);
+	}
+
+	__atomic_sub_fetch(&bus->waiters, 1, __ATOMIC_SEQ_CST);
+
+	return NULL;
+}
+
+/* Called with the poll lock held */
+int ugci_bus_get_fd(struct ugci_ctx *ctx)
+{
+	if (ctx->bus_fd >= 0)
+		return ctx->bus_fd;
+
+	if ((ctx->bus_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+		return -1;
+
+	ctx->bus_seen = ctx->bus_head;
+	ctx->bus_notify_stop = 0;
+
+	if (pthread_create(&ctx->bus_thread, NULL, ugci_bus_notify_main, ctx)) {
+		close(ctx->bus_fd);
+		ctx->bus_fd = -1;
+		return -1;
+	}
+
+	/* Anything already waiting */
+	if (ugci_bus_pending(ctx))
+		ugci_bus_notify(ctx);
+
+	return ctx->bus_fd;
+}
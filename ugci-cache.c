@@ -0,0 +1,213 @@
+/*
+ * Copyright (C) 2006 Ben Collins <bcollins@ubuntu.com>
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/* The probe cache. What we learn about each board (its EEPROM, which has
+ * the board type bits in the first byte) is kept in a file, so the same
+ * boards on the same ports do not have to be read again on the next
+ * start. An entry is only used if the board's security block still
+ * matches, so a swapped board is never mistaken for the old one.
+ *
+ * The file is a header followed by fixed size records, all in host byte
+ * order. It is only ever meant to be read back on the same machine. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <linux/types.h>
+#include <linux/hiddev.h>
+
+#include "ugci.h"
+#include "ugci-private.h"
+
+#define UGCI_CACHE_MAGIC	"UGCICACH"
+#define UGCI_CACHE_VERSION	1
+
+struct ugci_cache_header {
+	char magic[8];
+	unsigned int version;
+	unsigned int entry_size;
+	unsigned int entries;
+};
+
+static struct ugci_cache_entry *cache_find(struct ugci_ctx *ctx, int busnum, int devnum)
+{
+	int i;
+
+	for (i = 0; i < ctx->cache_len; i++) {
+		if (ctx->cache[i].busnum == busnum && ctx->cache[i].devnum == devnum)
+			return &ctx->cache[i];
+	}
+
+	return NULL;
+}
+
+static struct ugci_cache_entry *cache_add(struct ugci_ctx *ctx)
+{
+	if (ctx->cache_len == ctx->cache_size) {
+		int size = ctx->cache_size ? ctx->cache_size * 2 : 8;
+		struct ugci_cache_entry *cache = realloc(ctx->cache, size * sizeof(*cache));
+
+		if (!cache)
+			return NULL;
+
+		ctx->cache = cache;
+		ctx->cache_size = size;
+	}
+
+	return &ctx->cache[ctx->cache_len++];
+}
+
+/* A missing file is just an empty cache. Anything we don't understand is
+ * thrown away, and rewritten on close. */
+int ugci_cache_load(struct ugci_ctx *ctx)
+{
+	struct ugci_cache_header hdr;
+	struct ugci_cache_entry *ent;
+	unsigned int i;
+	FILE *f;
+
+	ctx->cache_len = 0;
+
+	if ((f = fopen(ctx->cache_path, "r")) == NULL)
+		return 0;
+
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+	    memcmp(hdr.magic, UGCI_CACHE_MAGIC, sizeof(hdr.magic)) ||
+	    hdr.version != UGCI_CACHE_VERSION ||
+	    hdr.entry_size != sizeof(*ent)) {
+		fclose(f);
+		return -1;
+	}
+
+	for (i = 0; i < hdr.entries; i++) {
+		if ((ent = cache_add(ctx)) == NULL)
+			break;
+
+		if (fread(ent, sizeof(*ent), 1, f) != 1 ||
+		    ent->eeprom_len < 0 || ent->eeprom_len > sizeof(ent->eeprom)) {
+			ctx->cache_len--;
+			break;
+		}
+	}
+
+	fclose(f);
+
+	return 0;
+}
+
+/* Written to the side and renamed over, so a crash never leaves half a
+ * cache behind */
+int ugci_cache_save(struct ugci_ctx *ctx)
+{
+	struct ugci_cache_header hdr;
+	char tmp[4096];
+	FILE *f;
+	int ret = 0;
+
+	pthread_mutex_lock(&ctx->cache_lock);
+
+	if (! ctx->cache_dirty)
+		goto out;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", ctx->cache_path) >= sizeof(tmp) ||
+	    (f = fopen(tmp, "w")) == NULL) {
+		ret = -1;
+		goto out;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, UGCI_CACHE_MAGIC, sizeof(hdr.magic));
+	hdr.version = UGCI_CACHE_VERSION;
+	hdr.entry_size = sizeof(struct ugci_cache_entry);
+	hdr.entries = ctx->cache_len;
+
+	if (fwrite(&hdr, sizeof(hdr), 1, f) != 1 ||
+	    fwrite(ctx->cache, sizeof(*ctx->cache), ctx->cache_len, f) != ctx->cache_len)
+		ret = -1;
+
+	if (fclose(f) || ret || rename(tmp, ctx->cache_path)) {
+		unlink(tmp);
+		ret = -1;
+		goto out;
+	}
+
+	ctx->cache_dirty = 0;
+
+out:
+	pthread_mutex_unlock(&ctx->cache_lock);
+
+	return ret;
+}
+
+void ugci_cache_free(struct ugci_ctx *ctx)
+{
+	free(ctx->cache);
+	ctx->cache = NULL;
+	ctx->cache_len = ctx->cache_size = 0;
+	ctx->cache_dirty = 0;
+}
+
+/* Fill in the device's EEPROM from the cache if we have seen this exact
+ * board here before. Returns 0 on a hit. Called with the device locked. */
+int ugci_cache_lookup(struct ugci_dev_info *dev, const unsigned char serial[UGCI_SEC_VALUES])
+{
+	struct ugci_ctx *ctx = dev->ctx;
+	struct ugci_cache_entry *ent;
+	int ret = -1;
+
+	pthread_mutex_lock(&ctx->cache_lock);
+
+	ent = cache_find(ctx, dev->busnum, dev->devnum);
+	if (ent && memcmp(ent->serial, serial, UGCI_SEC_VALUES) == 0) {
+		memcpy(dev->eeprom, ent->eeprom, ent->eeprom_len);
+		dev->eeprom_len = ent->eeprom_len;
+		ret = 0;
+	}
+
+	pthread_mutex_unlock(&ctx->cache_lock);
+
+	return ret;
+}
+
+/* Remember a freshly read EEPROM. Called with the device locked. */
+void ugci_cache_store(struct ugci_dev_info *dev, const unsigned char serial[UGCI_SEC_VALUES])
+{
+	struct ugci_ctx *ctx = dev->ctx;
+	struct ugci_cache_entry *ent;
+
+	pthread_mutex_lock(&ctx->cache_lock);
+
+	if ((ent = cache_find(ctx, dev->busnum, dev->devnum)) == NULL)
+		ent = cache_add(ctx);
+
+	if (ent) {
+		memset(ent, 0, sizeof(*ent));
+		ent->busnum = dev->busnum;
+		ent->devnum = dev->devnum;
+		memcpy(ent->serial, serial, UGCI_SEC_VALUES);
+		memcpy(ent->eeprom, dev->eeprom, dev->eeprom_len);
+		ent->eeprom_len = dev->eeprom_len;
+		ctx->cache_dirty = 1;
+	}
+
+	pthread_mutex_unlock(&ctx->cache_lock);
+}
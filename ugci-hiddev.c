@@ -0,0 +1,254 @@
+/* 
+ * Copyright (C) 2003,2006 Ben Collins <bcollins@ubuntu.com>
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <string.h>
+#include <dirent.h>
+
+#include <linux/types.h>
+#include <linux/hiddev.h>
+
+#include "ugci.h"
+#include "ugci-private.h"
+
+static const char *dev_path_fmts[] = {
+	"/dev/hiddev%d",
+	"/dev/usb/hiddev%d",
+	"/dev/usb/hid/hiddev%d",
+	NULL,
+};
+
+/* Checks a device for UGCI signatures. The vendor is one ioctl, so it
+ * goes first, before walking the applications. */
+static int is_happ_ugci(struct ugci_dev_info *dev, int fd)
+{
+	struct ugci_ctx *ctx = dev->ctx;
+	int i = 0, ret;
+	struct hiddev_devinfo dinfo;
+	unsigned int version;
+
+	if (ioctl(fd, HIDIOCGDEVINFO, &dinfo) < 0 ||
+	    dinfo.vendor != USB_VENDOR_ID_HAPP)
+		return 0;
+
+	while ((ret = ioctl(fd, HIDIOCAPPLICATION, i)) > 0 && ret != UGCI_PLAYER_APP)
+		i++;
+
+	if (ret != UGCI_PLAYER_APP)
+		return 0;
+
+	ioctl(fd, HIDIOCGVERSION, &version);
+	if (version < MIN_HID_VERSION) {
+		fprintf(stderr, "  HID Version is %d.%d.%d. Need a "
+			"minimum of %d.%d.%d.\n",
+			version >> 16, (version >> 8) & 0xff, version & 0xff,
+			MIN_HID_VERSION >> 16, (MIN_HID_VERSION >> 8) & 0xff,
+			MIN_HID_VERSION & 0xff);
+		ctx->hiddev_ok = 0;
+		return 0;
+	}
+
+	if (ctx->info_out && ! ctx->hiddev_ver_shown++)
+		printf("  HID device driver version is %d.%d.%d\n",
+			version >> 16, (version >> 8) & 0xff, version & 0xff);
+
+	if (ctx->info_out)
+		printf("  HID Bus(%d) DevNum(%d) IFNum(%d)\n",
+			dinfo.busnum, dinfo.devnum, dinfo.ifnum);
+
+	dev->busnum = dinfo.busnum;
+	dev->devnum = dinfo.devnum;
+
+	return 1;
+}
+
+
+/* Where the formats above put the nodes */
+static const char *dev_dirs[] = {
+	"/dev",
+	"/dev/usb",
+	"/dev/usb/hid",
+	NULL,
+};
+
+#define SYSFS_USBMISC	"/sys/class/usbmisc"
+
+/* Raises *nodes to one past the highest hiddev in dir. Returns less than
+ * zero if the directory is not there. */
+static int scan_nodes(const char *path, int *nodes)
+{
+	struct dirent *de;
+	DIR *dir;
+	int index;
+
+	if ((dir = opendir(path)) == NULL)
+		return -1;
+
+	while ((de = readdir(dir)) != NULL) {
+		if (sscanf(de->d_name, "hiddev%d", &index) == 1 &&
+		    index >= *nodes)
+			*nodes = index + 1;
+	}
+
+	closedir(dir);
+
+	return 0;
+}
+
+/* One past the highest numbered hiddev node present. Holes are fine, the
+ * open of a missing node just fails. sysfs has every node the kernel
+ * knows about, so the /dev directories are only needed without it. */
+static int hiddev_nodes(void)
+{
+	int t, nodes = 0;
+
+	if (scan_nodes(SYSFS_USBMISC, &nodes) == 0)
+		return nodes;
+
+	for (t = 0; dev_path_fmts[t]; t++)
+		scan_nodes(dev_dirs[t], &nodes);
+
+	return nodes;
+}
+
+/* Ask sysfs whether a node is a Happ board, without opening it. Returns
+ * 1 if it is, with the node's path filled in, 0 if it is not, and less
+ * than zero if sysfs can't tell us. */
+static int hiddev_sysfs_probe(int index, char *path, int len)
+{
+	char buf[128], line[128];
+	unsigned int vendor;
+	FILE *f;
+	int ret;
+
+	/* The node's device is the USB interface. The ids are on the USB
+	 * device above it. */
+	snprintf(buf, sizeof(buf), SYSFS_USBMISC "/hiddev%d/device/../idVendor", index);
+	if ((f = fopen(buf, "r")) == NULL)
+		return -1;
+	ret = fscanf(f, "%x", &vendor);
+	fclose(f);
+
+	if (ret != 1)
+		return -1;
+
+	if (vendor != USB_VENDOR_ID_HAPP)
+		return 0;
+
+	/* Where udev (or devtmpfs) put it */
+	path[0] = '\0';
+	snprintf(buf, sizeof(buf), SYSFS_USBMISC "/hiddev%d/uevent", index);
+	if ((f = fopen(buf, "r")) != NULL) {
+		while (fgets(line, sizeof(line), f)) {
+			if (strncmp(line, "DEVNAME=", 8) == 0) {
+				line[strcspn(line, "\n")] = '\0';
+				if (snprintf(path, len, "/dev/%s", line + 8) >= len)
+					path[0] = '\0';
+				break;
+			}
+		}
+		fclose(f);
+	}
+
+	return 1;
+}
+
+static int hiddev_open(struct ugci_dev_info *dev, int index, char *name, int len)
+{
+	int t, fd = -1;
+
+	t = hiddev_sysfs_probe(index, dev->path, sizeof(dev->path));
+	if (t == 0)
+		return -1;
+	if (t > 0 && dev->path[0])
+		fd = open(dev->path, O_RDONLY | O_NONBLOCK);
+
+	for (t = 0; fd < 0 && dev_path_fmts[t]; t++) {
+		snprintf(dev->path, sizeof(dev->path), dev_path_fmts[t], index);
+		fd = open(dev->path, O_RDONLY | O_NONBLOCK);
+	}
+
+	if (fd < 0)
+		return -1;
+
+	if (! is_happ_ugci(dev, fd)) {
+		close(fd);
+		return -1;
+	}
+
+	ioctl(fd, HIDIOCGNAME(len), name);
+
+	/* Physical location, so we know it when it comes back */
+	if (ioctl(fd, HIDIOCGPHYS(sizeof(dev->phys)), dev->phys) < 0)
+		dev->phys[0] = '\0';
+
+	/* Enable events */
+	t = HIDDEV_FLAG_UREF | HIDDEV_FLAG_REPORT;
+	ioctl(fd, HIDIOCSFLAG, &t);
+
+	/* Make sure the reports for the hiddev are initialized */
+	ioctl(fd, HIDIOCINITREPORT, 0);
+
+	return fd;
+}
+
+static void hiddev_close(struct ugci_dev_info *dev)
+{
+	close(dev->fd);
+}
+
+static int hiddev_get_usages(struct ugci_dev_info *dev,
+			     struct hiddev_usage_ref_multi *uref_multi)
+{
+	return ioctl(dev->fd, HIDIOCGUSAGES, uref_multi);
+}
+
+static int hiddev_set_usages(struct ugci_dev_info *dev,
+			     struct hiddev_usage_ref_multi *uref_multi)
+{
+	return ioctl(dev->fd, HIDIOCSUSAGES, uref_multi);
+}
+
+static int hiddev_set_report(struct ugci_dev_info *dev,
+			     struct hiddev_report_info *rinfo)
+{
+	return ioctl(dev->fd, HIDIOCSREPORT, rinfo);
+}
+
+static ssize_t hiddev_read(struct ugci_dev_info *dev,
+			   struct hiddev_usage_ref *ev, size_t len)
+{
+	return read(dev->fd, ev, len);
+}
+
+const struct ugci_backend ugci_hiddev_backend = {
+	.name		= "hiddev",
+	.node		= "hiddev",
+	.nodes		= hiddev_nodes,
+	.open		= hiddev_open,
+	.close		= hiddev_close,
+	.get_usages	= hiddev_get_usages,
+	.set_usages	= hiddev_set_usages,
+	.set_report	= hiddev_set_report,
+	.read		= hiddev_read,
+};
@@ -0,0 +1,634 @@
+/*
+ * Copyright (C) 2006 Ben Collins <bcollins@ubuntu.com>
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/* Talks to the boards through hidraw instead of hiddev. hidraw hands back
+ * each input report as the raw bytes off the wire, a few bytes for a
+ * player, where hiddev sends a 24 byte usage ref for every value in it.
+ * The report descriptor is parsed once on open, into where each field
+ * sits in its report, and a read just pulls the values out at those
+ * offsets.
+ *
+ * Only the values that changed since the last report are handed up, as
+ * the same usage refs hiddev would have sent, so nothing above the backend
+ * knows the difference. That makes this a cheaper transport and nothing
+ * more: each changed value still goes through the same per-usage decode
+ * in ugci.c as it does with hiddev. Fields are numbered the way the kernel numbers
+ * them for hiddev (padding does not count), so the usage refs in
+ * ugci-urefs.c work as they are. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <string.h>
+#include <dirent.h>
+#include <errno.h>
+
+#include <linux/types.h>
+#include <linux/hiddev.h>
+#include <linux/hidraw.h>
+
+#include "ugci.h"
+#include "ugci-private.h"
+
+#define SYSFS_HIDRAW		"/sys/class/hidraw"
+
+/* Plenty for a UGCI, which has a couple of dozen of each */
+#define HIDRAW_REPORTS		64
+#define HIDRAW_FIELDS		128
+#define HIDRAW_USAGES		16
+
+/* Report descriptor items, as (tag << 4 | type << 2) */
+#define ITEM_INPUT		0x80
+#define ITEM_OUTPUT		0x90
+#define ITEM_FEATURE		0xb0
+#define ITEM_COLLECTION		0xa0
+#define ITEM_END_COLLECTION	0xc0
+#define ITEM_USAGE_PAGE		0x04
+#define ITEM_LOGICAL_MIN	0x14
+#define ITEM_REPORT_SIZE	0x74
+#define ITEM_REPORT_ID		0x84
+#define ITEM_REPORT_COUNT	0x94
+#define ITEM_PUSH		0xa4
+#define ITEM_POP		0xb4
+#define ITEM_USAGE		0x08
+#define ITEM_USAGE_MIN		0x18
+#define ITEM_USAGE_MAX		0x28
+#define ITEM_LONG		0xfe
+
+#define COLLECTION_APPLICATION	0x01
+#define HIDRAW_GLOBAL_STACK	4
+
+struct hidraw_field {
+	unsigned int offset;	/* In bits, not counting the report ID */
+	unsigned int size;	/* Bits per value */
+	unsigned int count;
+	int is_signed;
+	unsigned int usages[HIDRAW_USAGES];
+	int nusages;		/* The last one repeats for the rest */
+};
+
+struct hidraw_report {
+	int type;		/* HID_REPORT_TYPE_* */
+	int id;
+	unsigned int bits;
+	int first, nfields;	/* In the field table */
+
+	/* As the ioctls want it, report ID first (zero if reports are not
+	 * numbered). For input, the last one seen, which is valid once it
+	 * has been read or asked for. It stays current once the board has
+	 * started sending it (streamed). Otherwise it is what goes out next. */
+	unsigned char *data;
+	int len;
+	int valid;
+	int streamed;
+};
+
+struct ugci_hidraw {
+	struct hidraw_report reports[HIDRAW_REPORTS];
+	int nreports;
+	struct hidraw_field fields[HIDRAW_FIELDS];
+	int nfields;
+	int numbered;		/* Reports start with their ID */
+	unsigned char *buf;	/* For read(), laid out like a report's data */
+	int buf_len;
+};
+
+/* What the parser carries between main items */
+struct hidraw_globals {
+	unsigned int page;
+	int logical_min;
+	unsigned int size;
+	unsigned int count;
+	int id;
+};
+
+static struct hidraw_report *hidraw_find_report(struct ugci_hidraw *hr, int type, int id)
+{
+	int i;
+
+	for (i = 0; i < hr->nreports; i++) {
+		if (hr->reports[i].type == type && hr->reports[i].id == id)
+			return &hr->reports[i];
+	}
+
+	return NULL;
+}
+
+static struct hidraw_report *hidraw_new_report(struct ugci_hidraw *hr, int type, int id)
+{
+	struct hidraw_report *rep = hidraw_find_report(hr, type, id);
+
+	if (rep || hr->nreports == HIDRAW_REPORTS)
+		return rep;
+
+	rep = &hr->reports[hr->nreports++];
+	rep->type = type;
+	rep->id = id;
+	rep->first = -1;
+
+	return rep;
+}
+
+static struct hidraw_field *hidraw_find_field(struct ugci_hidraw *hr,
+					      const struct hiddev_usage_ref *uref,
+					      struct hidraw_report **repp)
+{
+	struct hidraw_report *rep = hidraw_find_report(hr, uref->report_type,
+						       uref->report_id);
+
+	if (!rep || uref->field_index >= rep->nfields)
+		return NULL;
+
+	*repp = rep;
+
+	return &hr->fields[rep->first + uref->field_index];
+}
+
+static inline unsigned int hidraw_usage(const struct hidraw_field *f, int i)
+{
+	return f->usages[i < f->nusages ? i : f->nusages - 1];
+}
+
+/* Fields are only ever added to the last report they were seen in, and
+ * the kernel numbers them in the order they come. A report that shows up
+ * again after another one would get its fields out of order, which the
+ * UGCI never does. */
+static int hidraw_add_field(struct ugci_hidraw *hr, int type,
+			    const struct hidraw_globals *g,
+			    const unsigned int *usages, int nusages)
+{
+	struct hidraw_report *rep = hidraw_new_report(hr, type, g->id);
+	struct hidraw_field *f;
+
+	if (!rep)
+		return -1;
+
+	if (g->id)
+		hr->numbered = 1;
+
+	/* Padding takes up room, but is not a field */
+	if (nusages && g->size) {
+		if (hr->nfields == HIDRAW_FIELDS ||
+		    (rep->first >= 0 && rep->first + rep->nfields != hr->nfields))
+			return -1;
+
+		if (rep->first < 0)
+			rep->first = hr->nfields;
+
+		f = &hr->fields[hr->nfields++];
+		f->offset = rep->bits;
+		f->size = g->size;
+		f->count = g->count;
+		f->is_signed = g->logical_min < 0;
+		memcpy(f->usages, usages, nusages * sizeof(usages[0]));
+		f->nusages = nusages;
+		rep->nfields++;
+	}
+
+	rep->bits += g->size * g->count;
+
+	return 0;
+}
+
+static int hidraw_item_value(const unsigned char *p, int size, int is_signed)
+{
+	switch (size) {
+		case 1:
+			return is_signed ? (signed char)p[0] : p[0];
+		case 2:
+			return is_signed ? (short)(p[0] | p[1] << 8) : (p[0] | p[1] << 8);
+		case 4:
+			return p[0] | p[1] << 8 | p[2] << 16 | (unsigned int)p[3] << 24;
+	}
+
+	return 0;
+}
+
+/* Walk the report descriptor into reports and fields. Returns less than
+ * zero if it doesn't make sense, or has no UGCI player application. */
+static int hidraw_parse(struct ugci_hidraw *hr, const unsigned char *desc, int len)
+{
+	struct hidraw_globals g, stack[HIDRAW_GLOBAL_STACK];
+	unsigned int usages[HIDRAW_USAGES], umin = 0, u;
+	int i, size, data, nusages = 0, depth = 0, sp = 0, player_app = 0;
+	const unsigned char *p = desc, *end = desc + len;
+
+	memset(&g, 0, sizeof(g));
+
+	while (p < end) {
+		if (*p == ITEM_LONG) {
+			if (end - p < 3)
+				return -1;
+			p += 3 + p[1];
+			continue;
+		}
+
+		size = (*p & 3) == 3 ? 4 : (*p & 3);
+		if (end - p < 1 + size)
+			return -1;
+
+		data = hidraw_item_value(p + 1, size, (*p & 0xfc) == ITEM_LOGICAL_MIN);
+
+		switch (*p & 0xfc) {
+			case ITEM_INPUT:
+			case ITEM_OUTPUT:
+			case ITEM_FEATURE:
+				i = (*p & 0xfc) == ITEM_INPUT ? HID_REPORT_TYPE_INPUT :
+				    (*p & 0xfc) == ITEM_OUTPUT ? HID_REPORT_TYPE_OUTPUT :
+				    HID_REPORT_TYPE_FEATURE;
+				if (hidraw_add_field(hr, i, &g, usages, nusages))
+					return -1;
+				nusages = 0;
+				break;
+			case ITEM_COLLECTION:
+				if (data == COLLECTION_APPLICATION && nusages &&
+				    usages[0] == UGCI_PLAYER_APP)
+					player_app = 1;
+				depth++;
+				nusages = 0;
+				break;
+			case ITEM_END_COLLECTION:
+				if (--depth < 0)
+					return -1;
+				nusages = 0;
+				break;
+
+			case ITEM_USAGE_PAGE:
+				g.page = data;
+				break;
+			case ITEM_LOGICAL_MIN:
+				g.logical_min = data;
+				break;
+			case ITEM_REPORT_SIZE:
+				g.size = data;
+				break;
+			case ITEM_REPORT_ID:
+				g.id = data;
+				break;
+			case ITEM_REPORT_COUNT:
+				g.count = data;
+				break;
+			case ITEM_PUSH:
+				if (sp == HIDRAW_GLOBAL_STACK)
+					return -1;
+				stack[sp++] = g;
+				break;
+			case ITEM_POP:
+				if (sp == 0)
+					return -1;
+				g = stack[--sp];
+				break;
+
+			case ITEM_USAGE:
+				if (nusages < HIDRAW_USAGES)
+					usages[nusages++] = size == 4 ? data : (g.page << 16) | data;
+				break;
+			case ITEM_USAGE_MIN:
+				umin = size == 4 ? data : (g.page << 16) | data;
+				break;
+			case ITEM_USAGE_MAX:
+				u = size == 4 ? data : (g.page << 16) | data;
+				for (; umin <= u && nusages < HIDRAW_USAGES; umin++)
+					usages[nusages++] = umin;
+				break;
+		}
+
+		p += 1 + size;
+	}
+
+	if (!player_app)
+		return -1;
+
+	/* Give every report somewhere to live, with its ID up front */
+	for (i = 0; i < hr->nreports; i++) {
+		struct hidraw_report *rep = &hr->reports[i];
+
+		rep->len = 1 + (rep->bits + 7) / 8;
+		if ((rep->data = calloc(1, rep->len)) == NULL)
+			return -1;
+		rep->data[0] = rep->id;
+
+		if (rep->type == HID_REPORT_TYPE_INPUT && rep->len > hr->buf_len)
+			hr->buf_len = rep->len;
+	}
+
+	if (!hr->buf_len || (hr->buf = malloc(hr->buf_len)) == NULL)
+		return -1;
+
+	return 0;
+}
+
+/* Values are little endian bit fields, packed with no regard for bytes.
+ * The data is a report's, after the ID. */
+static int hidraw_extract(const unsigned char *data, const struct hidraw_field *f,
+			  int index)
+{
+	unsigned int bit = f->offset + index * f->size, value = 0, i;
+
+	for (i = 0; i < f->size && i < 32; i++, bit++)
+		value |= ((data[bit / 8] >> (bit % 8)) & 1) << i;
+
+	if (f->is_signed && f->size < 32 && (value & (1U << (f->size - 1))))
+		value |= ~0U << f->size;
+
+	return value;
+}
+
+static void hidraw_insert(unsigned char *data, const struct hidraw_field *f,
+			  int index, int value)
+{
+	unsigned int bit = f->offset + index * f->size, i;
+
+	for (i = 0; i < f->size && i < 32; i++, bit++) {
+		if (value & (1U << i))
+			data[bit / 8] |= 1 << (bit % 8);
+		else
+			data[bit / 8] &= ~(1 << (bit % 8));
+	}
+}
+
+/* Fetch an input or feature report from the board itself */
+static int hidraw_get_report(struct ugci_dev_info *dev, struct hidraw_report *rep)
+{
+	int ret;
+
+	if (rep->type == HID_REPORT_TYPE_FEATURE)
+		ret = ioctl(dev->fd, HIDIOCGFEATURE(rep->len), rep->data);
+	else
+		ret = ioctl(dev->fd, HIDIOCGINPUT(rep->len), rep->data);
+
+	return ret < 0 ? -1 : 0;
+}
+
+static int hidraw_nodes(void)
+{
+	struct dirent *de;
+	DIR *dir;
+	int index, nodes = 0;
+
+	if ((dir = opendir(SYSFS_HIDRAW)) == NULL &&
+	    (dir = opendir("/dev")) == NULL)
+		return 0;
+
+	while ((de = readdir(dir)) != NULL) {
+		if (sscanf(de->d_name, "hidraw%d", &index) == 1 && index >= nodes)
+			nodes = index + 1;
+	}
+
+	closedir(dir);
+
+	return nodes;
+}
+
+/* The node's device is the HID device, on top of the USB interface, on
+ * top of the USB device that has the numbers */
+static int hidraw_sysfs_num(int index, const char *file)
+{
+	char buf[128];
+	FILE *f;
+	int num = 0;
+
+	snprintf(buf, sizeof(buf), SYSFS_HIDRAW "/hidraw%d/device/../../%s", index, file);
+	if ((f = fopen(buf, "r")) != NULL) {
+		if (fscanf(f, "%d", &num) != 1)
+			num = 0;
+		fclose(f);
+	}
+
+	return num;
+}
+
+static int hidraw_open(struct ugci_dev_info *dev, int index, char *name, int len)
+{
+	struct ugci_ctx *ctx = dev->ctx;
+	struct hidraw_report_descriptor desc;
+	struct hidraw_devinfo dinfo;
+	struct ugci_hidraw *hr;
+	int fd;
+
+	snprintf(dev->path, sizeof(dev->path), "/dev/hidraw%d", index);
+
+	if ((fd = open(dev->path, O_RDWR | O_NONBLOCK | O_CLOEXEC)) < 0)
+		return -1;
+
+	if (ioctl(fd, HIDIOCGRAWINFO, &dinfo) < 0 ||
+	    (unsigned short)dinfo.vendor != USB_VENDOR_ID_HAPP ||
+	    ioctl(fd, HIDIOCGRDESCSIZE, &desc.size) < 0 ||
+	    ioctl(fd, HIDIOCGRDESC, &desc) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	if ((hr = calloc(1, sizeof(*hr))) == NULL) {
+		close(fd);
+		return -1;
+	}
+
+	dev->priv = hr;
+	dev->fd = fd;
+
+	if (hidraw_parse(hr, desc.value, desc.size)) {
+		DPRINT("UGCI: %s has no usable report descriptor\n", dev->path);
+		dev->be->close(dev);
+		return -1;
+	}
+
+	if (ioctl(fd, HIDIOCGRAWNAME(len), name) < 0)
+		snprintf(name, len, "Happ Controls UGCI");
+
+	/* Physical location, so we know it when it comes back. This is the
+	 * same string hiddev gives, so the two can share a cache file. */
+	if (ioctl(fd, HIDIOCGRAWPHYS(sizeof(dev->phys)), dev->phys) < 0)
+		dev->phys[0] = '\0';
+
+	dev->busnum = hidraw_sysfs_num(index, "busnum");
+	dev->devnum = hidraw_sysfs_num(index, "devnum");
+
+	if (ctx->info_out)
+		printf("  HID Bus(%d) DevNum(%d) %d reports, %d fields\n",
+		       dev->busnum, dev->devnum, hr->nreports, hr->nfields);
+
+	return fd;
+}
+
+static void hidraw_close(struct ugci_dev_info *dev)
+{
+	struct ugci_hidraw *hr = dev->priv;
+	int i;
+
+	close(dev->fd);
+
+	for (i = 0; i < hr->nreports; i++)
+		free(hr->reports[i].data);
+	free(hr->buf);
+	free(hr);
+	dev->priv = NULL;
+}
+
+/* Input comes from the last report read, the same as hiddev's copy, so the
+ * player reports do not go out on the wire. Ones the board does not send
+ * by itself, like the security block, are asked for. So are features, and
+ * output is whatever is waiting to go. */
+static int hidraw_get_usages(struct ugci_dev_info *dev,
+			     struct hiddev_usage_ref_multi *uref_multi)
+{
+	struct ugci_hidraw *hr = dev->priv;
+	struct hidraw_report *rep;
+	struct hidraw_field *f;
+	int i;
+
+	if ((f = hidraw_find_field(hr, &uref_multi->uref, &rep)) == NULL ||
+	    uref_multi->num_values > HID_MAX_MULTI_USAGES ||
+	    uref_multi->uref.usage_index + uref_multi->num_values > f->count) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (rep->type == HID_REPORT_TYPE_FEATURE ||
+	    (rep->type == HID_REPORT_TYPE_INPUT && !rep->streamed)) {
+		if (hidraw_get_report(dev, rep))
+			return -1;
+		rep->valid = 1;
+	}
+
+	for (i = 0; i < uref_multi->num_values; i++)
+		uref_multi->values[i] = hidraw_extract(rep->data + 1, f,
+						       uref_multi->uref.usage_index + i);
+
+	return 0;
+}
+
+static int hidraw_set_usages(struct ugci_dev_info *dev,
+			     struct hiddev_usage_ref_multi *uref_multi)
+{
+	struct ugci_hidraw *hr = dev->priv;
+	struct hidraw_report *rep;
+	struct hidraw_field *f;
+	int i;
+
+	if ((f = hidraw_find_field(hr, &uref_multi->uref, &rep)) == NULL ||
+	    rep->type == HID_REPORT_TYPE_INPUT ||
+	    uref_multi->num_values > HID_MAX_MULTI_USAGES ||
+	    uref_multi->uref.usage_index + uref_multi->num_values > f->count) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (i = 0; i < uref_multi->num_values; i++)
+		hidraw_insert(rep->data + 1, f, uref_multi->uref.usage_index + i,
+			      uref_multi->values[i]);
+
+	return 0;
+}
+
+static int hidraw_set_report(struct ugci_dev_info *dev,
+			     struct hiddev_report_info *rinfo)
+{
+	struct ugci_hidraw *hr = dev->priv;
+	struct hidraw_report *rep = hidraw_find_report(hr, rinfo->report_type,
+						       rinfo->report_id);
+
+	if (!rep || rep->type == HID_REPORT_TYPE_INPUT) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (rep->type == HID_REPORT_TYPE_FEATURE)
+		return ioctl(dev->fd, HIDIOCSFEATURE(rep->len), rep->data) < 0 ? -1 : 0;
+
+	return write(dev->fd, rep->data, rep->len) == rep->len ? 0 : -1;
+}
+
+/* One read(2) is one report, and we only do the one. Another read would
+ * most often just say EAGAIN, where a single hiddev read gets everything,
+ * so a report that is still waiting is left for the next poll. It is cut
+ * short if it doesn't fit. */
+static ssize_t hidraw_read(struct ugci_dev_info *dev,
+			   struct hiddev_usage_ref *ev, size_t len)
+{
+	struct ugci_hidraw *hr = dev->priv;
+	struct hidraw_report *rep;
+	struct hidraw_field *f;
+	size_t n = 0, max = len / sizeof(*ev);
+	int rd, i, t, value;
+
+	/* Unnumbered reports come without an ID, so make room for one */
+	rd = read(dev->fd, hr->buf + !hr->numbered, hr->buf_len - !hr->numbered);
+	if (rd < 0)
+		return -1;
+
+	if (!hr->numbered) {
+		hr->buf[0] = 0;
+		rd++;
+	}
+
+	if ((rep = hidraw_find_report(hr, HID_REPORT_TYPE_INPUT, hr->buf[0])) == NULL) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	/* A short one keeps the last values for the rest */
+	if (rd < rep->len)
+		memcpy(hr->buf + rd, rep->data + rd, rep->len - rd);
+
+	for (t = 0; t < rep->nfields; t++) {
+		f = &hr->fields[rep->first + t];
+
+		for (i = 0; i < f->count && n < max; i++) {
+			value = hidraw_extract(hr->buf + 1, f, i);
+
+			if (rep->valid && value == hidraw_extract(rep->data + 1, f, i))
+				continue;
+
+			ev[n].report_type = HID_REPORT_TYPE_INPUT;
+			ev[n].report_id = rep->id;
+			ev[n].field_index = t;
+			ev[n].usage_index = i;
+			ev[n].usage_code = hidraw_usage(f, i);
+			ev[n].value = value;
+			n++;
+		}
+	}
+
+	memcpy(rep->data, hr->buf, rep->len);
+	rep->valid = rep->streamed = 1;
+
+	/* Nothing changed */
+	if (!n) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	return n * sizeof(*ev);
+}
+
+const struct ugci_backend ugci_hidraw_backend = {
+	.name		= "hidraw",
+	.node		= "hidraw",
+	.nodes		= hidraw_nodes,
+	.open		= hidraw_open,
+	.close		= hidraw_close,
+	.get_usages	= hidraw_get_usages,
+	.set_usages	= hidraw_set_usages,
+	.set_report	= hidraw_set_report,
+	.read		= hidraw_read,
+};
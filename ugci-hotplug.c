@@ -0,0 +1,127 @@
+/*
+ * Copyright (C) 2006 Ben Collins <bcollins@ubuntu.com>
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/* Listens for uevents on netlink so boards can come and go without
+ * re-running ugci_init(). We listen to both the kernel's own messages and
+ * udev's re-broadcast of them. The kernel one is there even if no udevd
+ * is running, but the node may not have the right permissions yet. The
+ * udev one comes after the rules have been applied. Attaching is
+ * idempotent, so whichever works first wins. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <string.h>
+#include <errno.h>
+
+#include <linux/types.h>
+#include <linux/netlink.h>
+#include <linux/hiddev.h>
+
+#include "ugci.h"
+#include "ugci-private.h"
+
+#define UEVENT_KERNEL_GROUP	1
+#define UEVENT_UDEV_GROUP	2
+
+/* Offsets into udev's struct udev_monitor_netlink_header */
+#define UDEV_HDR_PROPS_OFF	16
+#define UDEV_HDR_PROPS_LEN	20
+
+int ugci_hotplug_open(void)
+{
+	struct sockaddr_nl addr;
+	int fd;
+
+	fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+		    NETLINK_KOBJECT_UEVENT);
+	if (fd < 0)
+		return -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = UEVENT_KERNEL_GROUP | UEVENT_UDEV_GROUP;
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/* Reads one message. Returns 1 if it was a node of the backend's (say
+ * hiddev3 for node "hiddev") being added or removed, with *add and *index
+ * filled in, 0 for anything else, and less than zero when there is nothing
+ * left to read. */
+int ugci_hotplug_read(int fd, const char *node, int *add, int *index)
+{
+	char buf[8192], *p, *end;
+	const char *action = NULL, *devname = NULL, *base;
+	unsigned int off, len;
+	size_t nlen = strlen(node);
+	ssize_t rd;
+
+	rd = recv(fd, buf, sizeof(buf) - 1, 0);
+	if (rd <= 0)
+		return -1;
+
+	buf[rd] = '\0';
+	end = buf + rd;
+
+	if (rd >= UDEV_HDR_PROPS_LEN + 4 && memcmp(buf, "libudev", 8) == 0) {
+		memcpy(&off, buf + UDEV_HDR_PROPS_OFF, sizeof(off));
+		memcpy(&len, buf + UDEV_HDR_PROPS_LEN, sizeof(len));
+
+		if (off >= rd || len > rd - off)
+			return 0;
+
+		p = buf + off;
+		end = p + len;
+	} else {
+		/* The kernel's starts with "action@devpath" */
+		p = buf + strlen(buf) + 1;
+	}
+
+	for (; p < end; p += strlen(p) + 1) {
+		if (strncmp(p, "ACTION=", 7) == 0)
+			action = p + 7;
+		else if (strncmp(p, "DEVNAME=", 8) == 0)
+			devname = p + 8;
+	}
+
+	if (!action || !devname)
+		return 0;
+
+	base = strrchr(devname, '/') ? strrchr(devname, '/') + 1 : devname;
+	if (strncmp(base, node, nlen) || sscanf(base + nlen, "%d", index) != 1)
+		return 0;
+
+	if (strcmp(action, "add") == 0)
+		*add = 1;
+	else if (strcmp(action, "remove") == 0)
+		*add = 0;
+	else
+		return 0;
+
+	DPRINT("UGCI: uevent %s %s%d\n", action, node, *index);
+
+	return 1;
+}
@@ -19,14 +19,54 @@
 #ifndef UGCI_PRIVATE_H
 #define UGCI_PRIVATE_H 1
 
+#include <stdio.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include <linux/types.h>
+#include <linux/hiddev.h>
+
+#include "ugci.h"
+
 #ifdef DEBUG
 #define DPRINT(fmt, args...) fprintf(stderr, fmt, ## args)
 #else
 #define DPRINT(fmt, args...) do{}while(0)
 #endif
 
-/* Enough for 8 players should be a good default */
-#define UGCI_MAX_DEVS			4
+/* CLOCK_MONOTONIC in ns, what every event time and deadline is in */
+static inline unsigned long long ugci_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* What low-latency mode has changed on a thread */
+#define UGCI_LL_SCHED			0x1
+#define UGCI_LL_CPU			0x2
+
+/* Initial size of the device table, it grows as boards are found */
+#define UGCI_DEVS_INIT			4
+
+/* Every stats field has only the one writer (whoever holds the device,
+ * write or poll lock it goes with), so a plain add is enough, as long as
+ * readers never see it torn */
+#define UGCI_STAT_ADD(var, n)	__atomic_store_n(&(var), (var) + (n), __ATOMIC_RELAXED)
+
+static inline void ugci_stat_hist(unsigned long long *hist, unsigned long long ns)
+{
+	unsigned long long us = ns / 1000;
+	int b = us ? 64 - __builtin_clzll(us) : 0;
+
+	if (b >= UGCI_STATS_BUCKETS)
+		b = UGCI_STATS_BUCKETS - 1;
+
+	UGCI_STAT_ADD(hist[b], 1);
+}
 
 /* We need the support of urefs and collections */
 #define MIN_HID_VERSION 0x010004
@@ -35,26 +75,302 @@
 #error Your HIDDev header is too old.
 #endif
 
+struct ugci_dev_info;
+struct ugci_bus;
+
+/* Low level access to a device. Everything above this layer only deals in
+ * usage refs, so the real hiddev nodes can be swapped out for something
+ * else, like the simulated UGCI in ugci-sim.c. */
+struct ugci_backend {
+	const char *name;
+
+	/* Device nodes are this and the index, as hotplug sees them. NULL
+	 * if there are no real nodes. */
+	const char *node;
+
+	/* Number of device nodes to probe */
+	int (*nodes)(void);
+
+	/* Open the index'th node. Returns the fd to poll on, or less than
+	 * zero if there is no UGCI at that index. Must fill in dev->path,
+	 * dev->phys (anything that stays the same when the board is
+	 * unplugged and comes back on the same port), dev->busnum,
+	 * dev->devnum and the product name. */
+	int (*open)(struct ugci_dev_info *dev, int index, char *name, int len);
+	void (*close)(struct ugci_dev_info *dev);
+
+	/* HIDIOCGUSAGES, HIDIOCSUSAGES and HIDIOCSREPORT respectively */
+	int (*get_usages)(struct ugci_dev_info *dev, struct hiddev_usage_ref_multi *uref_multi);
+	int (*set_usages)(struct ugci_dev_info *dev, struct hiddev_usage_ref_multi *uref_multi);
+	int (*set_report)(struct ugci_dev_info *dev, struct hiddev_report_info *rinfo);
+
+	/* Returns bytes read, always a multiple of the usage ref size */
+	ssize_t (*read)(struct ugci_dev_info *dev, struct hiddev_usage_ref *ev, size_t len);
+};
+
+extern const struct ugci_backend ugci_hiddev_backend;
+extern const struct ugci_backend ugci_hidraw_backend;
+extern const struct ugci_backend ugci_sim_backend;
+extern const struct ugci_backend ugci_replay_backend;
+
+/* The recording format, see ugci-record.c */
+#define UGCI_REC_MAGIC		"UGCIRECD"
+#define UGCI_REC_VERSION	1
+
+struct ugci_rec_header {
+	char magic[8];
+	__u32 version;
+	__u32 uref_size;
+};
+
+/* Followed by count usage refs */
+struct ugci_rec_batch {
+	__u64 time;		/* CLOCK_MONOTONIC ns, when the read returned */
+	__u32 id;		/* Device ID */
+	__u32 count;
+};
+
+/* What each fd in the epoll set points back to */
+enum ugci_watch_type {
+	UGCI_WATCH_INPUT = 0,
+	UGCI_WATCH_TIMER,
+	UGCI_WATCH_WAKE,
+	UGCI_WATCH_HOTPLUG,
+};
+
+struct ugci_watch {
+	enum ugci_watch_type type;
+	struct ugci_dev_info *dev;
+};
+
+/* One of a board's commands for the writer thread, see ugci-writer.c.
+ * It is on the context's queue while pending. */
+struct ugci_cmd {
+	struct ugci_dev_info *dev;
+	enum ugci_command type;
+	int pending;
+	struct ugci_cmd *next;
+	unsigned long long queued;	/* CLOCK_MONOTONIC ns */
+	unsigned int values[UGCI_SEC_VALUES];
+};
+
 struct ugci_dev_info {
+	/* These belong to the slot and outlive any one device in it.
+	 * Everything from id on is reset on attach, see ugci_attach(). The
+	 * lock covers backend access and all the per-device state.
+	 * write_lock is taken inside it, and covers sending output reports
+	 * and reading the security block back. The writer thread only takes
+	 * that one, so changing fd, be or priv needs both. */
+	pthread_mutex_t lock;
+	pthread_mutex_t write_lock;
+	struct ugci_ring *ring;		/* Only while the reader thread runs */
+	struct ugci_stats stats;	/* See ugci_get_stats() */
+	struct ugci_cmd cmds[UGCI_CMD_MAX];	/* Under the ctx writer_lock */
+
 	int id;
+	struct ugci_ctx *ctx;
 
 	int fd;
 
-	/* Simul */
+	const struct ugci_backend *be;
+	void *priv;
+	char path[32];
+	char phys[64];
+	int busnum;
+	int devnum;
+
+	struct ugci_watch input_watch;
+	struct ugci_watch timer_watch;
+
+	/* CLOCK_MONOTONIC timerfd for the below deadlines */
+	int timer_fd;
+
+	/* Simul, times are CLOCK_MONOTONIC in ns */
 	int coin_pressed[2];
-	struct timeval last_tv[2];
+	unsigned long long coin_time[2];
 
-	/* Watchdog */
+	/* Watchdog. Only changed with write_lock held, and read without any
+	 * lock by the watchdog thread. */
 	unsigned int wd_interval;
-	time_t last_wd;
+	unsigned long long last_wd;
 
-	/* EEPROM */
+	/* EEPROM, read on first use. The state is one of UGCI_EEPROM_*, and
+	 * can be read without the lock. */
 	unsigned char eeprom[504];
-	int eeprom_valid;
+	int eeprom_state;
 	int eeprom_len;
 };
 
 
+/* Decoded events waiting to be handed out. Only ever filled when empty,
+ * and a gather only reads as many devices as fit, see UGCI_EPOLL_BATCH.
+ * This is the smallest it gets, it grows with the read buffer. */
+#define UGCI_EVQ_SIZE		1024
+
+/* One board in the probe cache, see ugci-cache.c */
+struct ugci_cache_entry {
+	int busnum;
+	int devnum;
+	unsigned char serial[14];
+	unsigned char eeprom[504];
+	int eeprom_len;
+};
+
+/* The published input state, see ugci-state.c */
+struct ugci_state_table {
+	struct ugci_state_table *old;	/* The one this replaced */
+	int size;
+	struct ugci_player_state player[];
+};
+
+/* Everything that used to be file-scope in ugci.c */
+struct ugci_ctx {
+	/* Slots are allocated once and never move or go away before the
+	 * context does, so pointers to them stay good. devs_lock only
+	 * covers the table itself, and growing it. */
+	struct ugci_dev_info **devs;
+	int ndevs;
+	int devs_size;
+	int active;
+	pthread_mutex_t devs_lock;
+
+	const struct ugci_backend *backend;
+	int hiddev_ok;
+	int hiddev_ver_shown;
+
+	int initialized;
+	int info_out;
+	int event_mask;
+	int sim_coin_wait;
+	ugci_callback_t cb;
+	ugci_event_callback_t event_cb;
+	void *event_cb_data;
+
+	int epfd;
+
+	/* Held by whoever is gathering or consuming events */
+	pthread_mutex_t poll_lock;
+
+	struct ugci_event *evq;
+	unsigned int evq_size;
+	unsigned int evq_head, evq_tail;
+
+	/* The consumer's copy of the slot table, so that the stats for each
+	 * event it hands out don't take devs_lock. Under poll_lock. */
+	struct ugci_dev_info **stat_devs;
+	int stat_ndevs;
+
+	/* See ugci_set_read_buffer(). The buffer is only used by whoever
+	 * is gathering, which is one thread at a time. */
+	int read_urefs;
+	int read_budget;
+	struct hiddev_usage_ref *read_buf;
+
+	/* For the poll(2) fallback */
+	struct pollfd *pfd;
+	struct ugci_dev_info **pdev;
+	int poll_size;
+
+	/* Threaded mode, see ugci_start_reader() */
+	pthread_t reader_thread;
+	int reader_running;
+	int reader_stop;
+	int reader_done;	/* The thread gave up, the last board went */
+	int reader_ring_size;
+	int reader_wake_fd;
+	struct ugci_watch reader_wake_watch;
+	int reader_notify_fd;
+	int consumer_waiting;
+
+	/* Rings with events in them. The reader thread pushes onto ready,
+	 * and the consumer moves them over to its own drain list. */
+	struct ugci_ring *ready;
+	struct ugci_ring *drain_head, *drain_tail;
+	/* Newest time pushed into any ring, and the consumer's heap for
+	 * merging them, see ugci_reader_drain() */
+	unsigned long long reader_time;
+	struct ugci_ring **merge;
+	int merge_size;
+
+	/* See ugci_set_low_latency(). Set under poll_lock, but ll_spin is
+	 * read by the reader thread without it. The spin windows (in ns) are
+	 * each only used by one side at a time. */
+	int ll_priority;
+	int ll_cpu;
+	int ll_spin;
+	int ll_locked;
+	unsigned long long gather_spin;
+	unsigned long long consume_spin;
+
+	/* What we changed on ll_thread (UGCI_LL_*), and what it had before */
+	int ll_changed;
+	pthread_t ll_thread;
+	int ll_policy;
+	struct sched_param ll_param;
+	cpu_set_t ll_set;
+
+	int hotplug_fd;
+	struct ugci_watch hotplug_watch;
+
+	/* See ugci_load_eeproms() */
+	pthread_t eeprom_thread;
+	int eeprom_started;
+	int eeprom_busy;
+	int eeprom_stop;
+
+	/* See ugci_set_cache() */
+	char *cache_path;
+	pthread_mutex_t cache_lock;
+	struct ugci_cache_entry *cache;
+	int cache_len;
+	int cache_size;
+	int cache_dirty;
+
+	/* See ugci_get_state(). Only the writers take state_lock. */
+	pthread_mutex_t state_lock;
+	unsigned int state_seq;
+	struct ugci_state_table *state;
+	int state_players;
+
+	/* See ugci_record() */
+	pthread_mutex_t record_lock;
+	FILE *record;
+
+	/* See ugci_publish(). We are either writing a bus (bus_out), or
+	 * reading one in place of any boards (bus). Both are under
+	 * poll_lock. */
+	int backend_set;
+	int bus_wanted;
+	struct ugci_bus *bus;
+	unsigned long long bus_head;
+	struct ugci_bus *bus_out;
+	char *bus_name;
+
+	/* ugci_get_fd() on a bus, an eventfd that a thread of our own keeps
+	 * readable when the bus has moved on */
+	int bus_fd;
+	int bus_notify_stop;
+	unsigned long long bus_seen;
+	pthread_t bus_thread;
+
+	/* See ugci_start_writer(). writer_lock covers the queue and the
+	 * callback. */
+	pthread_t writer_thread;
+	int writer_running;
+	int writer_stop;
+	pthread_mutex_t writer_lock;
+	pthread_cond_t writer_cond;
+	struct ugci_cmd *cmd_head, *cmd_tail;
+	ugci_command_callback_t cmd_cb;
+	void *cmd_cb_data;
+
+	/* See ugci_start_watchdog(). Started and stopped under poll_lock. */
+	pthread_t wd_thread;
+	int wd_running;
+	int wd_stop;
+};
+
+
 enum ugci_report_type {
 	UGCI_UREF_P1_COIN = 0,
 	UGCI_UREF_P1_PLAY,
@@ -72,8 +388,58 @@ enum ugci_report_type {
 };
 
 void ugci_fill_uref(enum ugci_report_type type, struct hiddev_usage_ref_multi *uref_multi);
+int ugci_find_uref(const struct hiddev_usage_ref *uref);
 int ugci_commit_uref(struct ugci_dev_info *dev, enum ugci_report_type type);
 
+/* ugci.c, called with write_lock held */
+int ugci_cmd_send(struct ugci_dev_info *dev, enum ugci_command cmd, const unsigned int *values);
+
+/* ugci-writer.c */
+int ugci_writer_queue(struct ugci_dev_info *dev, enum ugci_command cmd,
+		      const unsigned int *values, int count);
+
+/* ugci-cache.c */
+int ugci_cache_load(struct ugci_ctx *ctx);
+int ugci_cache_save(struct ugci_ctx *ctx);
+void ugci_cache_free(struct ugci_ctx *ctx);
+int ugci_cache_lookup(struct ugci_dev_info *dev, const unsigned char serial[14]);
+void ugci_cache_store(struct ugci_dev_info *dev, const unsigned char serial[14]);
+
+/* ugci-state.c */
+struct ugci_player_state *ugci_state_begin(struct ugci_ctx *ctx);
+void ugci_state_end(struct ugci_ctx *ctx);
+int ugci_state_reserve(struct ugci_ctx *ctx, int players);
+void ugci_state_free(struct ugci_ctx *ctx);
+void ugci_state_board(struct ugci_dev_info *dev, const struct ugci_board_state *state);
+
+/* Change one field of a player's state, between ugci_state_begin() and
+ * ugci_state_end(), bumping its sequence number if it really changed */
+#define UGCI_STATE_SET(ps, field, val) do {					\
+	__typeof__((ps)->field) __v = (val);					\
+	if ((ps)->field != __v) {						\
+		__atomic_store_n(&(ps)->field, __v, __ATOMIC_RELAXED);		\
+		__atomic_store_n(&(ps)->field##_seq, (ps)->field##_seq + 1,	\
+				 __ATOMIC_RELAXED);				\
+	}									\
+} while (0)
+
+/* ugci-bus.c */
+void ugci_bus_publish(struct ugci_ctx *ctx, const struct ugci_event *ev, int count);
+int ugci_bus_attach(struct ugci_ctx *ctx, const char *name, int quiet);
+void ugci_bus_detach(struct ugci_ctx *ctx);
+int ugci_bus_pending(struct ugci_ctx *ctx);
+int ugci_bus_events(struct ugci_ctx *ctx, struct ugci_event *out, int max, int timeout);
+int ugci_bus_get_fd(struct ugci_ctx *ctx);
+
+/* ugci-record.c */
+void ugci_record_batch(struct ugci_dev_info *dev, const struct hiddev_usage_ref *ev,
+		       int count, unsigned long long time);
+void ugci_record_flush(struct ugci_ctx *ctx);
+
+/* ugci-hotplug.c */
+int ugci_hotplug_open(void);
+int ugci_hotplug_read(int fd, const char *node, int *add, int *index);
+
 #define USB_VENDOR_ID_HAPP		0x078b
 #define USB_DEVICE_ID_UGCI_DRIVING	0x0010
 #define USB_DEVICE_ID_UGCI_FLYING	0x0020
@@ -0,0 +1,114 @@
+/*
+ * Copyright (C) 2006 Ben Collins <bcollins@ubuntu.com>
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/* Records every read from every device, exactly as the backend returned
+ * it, so it can be fed back through the replay backend (ugci-replay.c).
+ * The file is a header and then one batch after another, each one a small
+ * header (time, device and count) and the usage refs themselves. All of it
+ * is 8 byte aligned and in host byte order, so it can be mapped and walked
+ * in place. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdint.h>
+
+#include <linux/types.h>
+#include <linux/hiddev.h>
+
+#include "ugci.h"
+#include "ugci-private.h"
+
+/* Big enough that a busy board is not a write(2) per read */
+#define UGCI_RECORD_BUFSIZE	(256 * 1024)
+
+int ugci_ctx_record(struct ugci_ctx *ctx, const char *path)
+{
+	struct ugci_rec_header hdr;
+	FILE *f = NULL;
+	int ret = 0;
+
+	if (path) {
+		if ((f = fopen(path, "w")) == NULL)
+			return -1;
+
+		setvbuf(f, NULL, _IOFBF, UGCI_RECORD_BUFSIZE);
+
+		memset(&hdr, 0, sizeof(hdr));
+		memcpy(hdr.magic, UGCI_REC_MAGIC, sizeof(hdr.magic));
+		hdr.version = UGCI_REC_VERSION;
+		hdr.uref_size = sizeof(struct hiddev_usage_ref);
+
+		if (fwrite(&hdr, sizeof(hdr), 1, f) != 1) {
+			fclose(f);
+			return -1;
+		}
+	}
+
+	pthread_mutex_lock(&ctx->record_lock);
+
+	if (ctx->record && fclose(ctx->record))
+		ret = -1;
+
+	__atomic_store_n(&ctx->record, f, __ATOMIC_RELAXED);
+
+	pthread_mutex_unlock(&ctx->record_lock);
+
+	return ret;
+}
+
+/* Called with the device locked, right after the read */
+void ugci_record_batch(struct ugci_dev_info *dev, const struct hiddev_usage_ref *ev,
+		       int count, unsigned long long time)
+{
+	struct ugci_ctx *ctx = dev->ctx;
+	struct ugci_rec_batch batch;
+
+	memset(&batch, 0, sizeof(batch));
+	batch.time = time;
+	batch.id = dev->id;
+	batch.count = count;
+
+	pthread_mutex_lock(&ctx->record_lock);
+
+	/* A failed write leaves the file truncated at a batch, which the
+	 * replay is happy with. So just stop. */
+	if (ctx->record && (fwrite(&batch, sizeof(batch), 1, ctx->record) != 1 ||
+			    fwrite(ev, sizeof(*ev), count, ctx->record) != count)) {
+		fprintf(stderr, "UGCI: Recording failed, stopping\n");
+		fclose(ctx->record);
+		__atomic_store_n(&ctx->record, NULL, __ATOMIC_RELAXED);
+	}
+
+	pthread_mutex_unlock(&ctx->record_lock);
+}
+
+/* Get what we have to disk, when the last board goes and there may be
+ * nothing more for a while. Called with the device locked. */
+void ugci_record_flush(struct ugci_ctx *ctx)
+{
+	pthread_mutex_lock(&ctx->record_lock);
+
+	if (ctx->record)
+		fflush(ctx->record);
+
+	pthread_mutex_unlock(&ctx->record_lock);
+}
@@ -0,0 +1,453 @@
+/*
+ * Copyright (C) 2006 Ben Collins <bcollins@ubuntu.com>
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/* Plays back a file made by ugci_record(). Each device in the recording
+ * becomes a board, and its usage refs come back from read() exactly as
+ * they were recorded, so everything above the backend does just what it
+ * did the first time.
+ *
+ * The boards' batches are sorted out in one pass over the file when it is
+ * opened, so each board just steps through its own list of offsets.
+ *
+ * In real time, each board polls on a timerfd set for its next batch, at
+ * the same offset from the start as it was recorded. Otherwise it polls on
+ * an eventfd that is kept readable until the board runs out, and every
+ * read hands back as many batches as fit. Either way, a board just goes
+ * quiet at the end of the recording. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <linux/types.h>
+#include <linux/hiddev.h>
+
+#include "ugci.h"
+#include "ugci-private.h"
+
+/* Last value seen for each usage, for get_usages */
+#define REPLAY_VALUES		64
+
+/* Where one board's batches are in the file */
+struct replay_index {
+	size_t *off;
+	int len;
+	int size;
+};
+
+struct ugci_replay {
+	const char *map;
+	size_t size;
+	struct replay_index batches;
+	int next;		/* Next of batches to hand out */
+	int index;		/* Device number in the recording */
+	int realtime;
+
+	struct hiddev_usage_ref values[REPLAY_VALUES];
+	int nvalues;
+};
+
+static char *replay_path;
+static int replay_realtime;
+
+/* Set up by nodes(), so all of the boards start together */
+static unsigned long long replay_start, replay_first;
+
+/* Also from nodes(), each one taken over by the board's open() */
+static struct replay_index *replay_boards;
+static int replay_nboards;
+
+int ugci_replay_config(const char *path, int realtime)
+{
+	char *p = NULL;
+
+	if (path && (p = strdup(path)) == NULL)
+		return -1;
+
+	free(replay_path);
+	replay_path = p;
+	replay_realtime = realtime;
+
+	return 0;
+}
+
+static const char *replay_map(size_t *size)
+{
+	const struct ugci_rec_header *hdr;
+	struct stat st;
+	void *map;
+	int fd;
+
+	if (!replay_path || (fd = open(replay_path, O_RDONLY | O_CLOEXEC)) < 0)
+		return NULL;
+
+	if (fstat(fd, &st) || st.st_size < sizeof(*hdr)) {
+		close(fd);
+		return NULL;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED)
+		return NULL;
+
+	hdr = map;
+	if (memcmp(hdr->magic, UGCI_REC_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->version != UGCI_REC_VERSION ||
+	    hdr->uref_size != sizeof(struct hiddev_usage_ref)) {
+		munmap(map, st.st_size);
+		return NULL;
+	}
+
+	*size = st.st_size;
+
+	return map;
+}
+
+/* The batch at pos, or NULL if there is not a whole one there */
+static const struct ugci_rec_batch *replay_batch(const char *map, size_t size, size_t pos)
+{
+	const struct ugci_rec_batch *batch;
+
+	if (size - pos < sizeof(*batch))
+		return NULL;
+
+	batch = (const struct ugci_rec_batch *)(map + pos);
+
+	if ((size - pos - sizeof(*batch)) / sizeof(struct hiddev_usage_ref) < batch->count)
+		return NULL;
+
+	return batch;
+}
+
+static inline size_t replay_next(const struct ugci_rec_batch *batch, size_t pos)
+{
+	return pos + sizeof(*batch) + batch->count * sizeof(struct hiddev_usage_ref);
+}
+
+static int replay_index_add(struct replay_index *idx, size_t pos)
+{
+	size_t *off;
+
+	if (idx->len == idx->size) {
+		off = realloc(idx->off, (idx->size ? idx->size * 2 : 64) * sizeof(*off));
+		if (off == NULL)
+			return -1;
+		idx->off = off;
+		idx->size = idx->size ? idx->size * 2 : 64;
+	}
+
+	idx->off[idx->len++] = pos;
+
+	return 0;
+}
+
+static void replay_boards_free(void)
+{
+	int i;
+
+	for (i = 0; i < replay_nboards; i++)
+		free(replay_boards[i].off);
+	free(replay_boards);
+	replay_boards = NULL;
+	replay_nboards = 0;
+}
+
+/* This board's next batch, or NULL when it has run out */
+static const struct ugci_rec_batch *replay_cur(struct ugci_replay *rp)
+{
+	if (rp->next >= rp->batches.len)
+		return NULL;
+
+	return (const struct ugci_rec_batch *)(rp->map + rp->batches.off[rp->next]);
+}
+
+static void replay_arm(struct ugci_dev_info *dev)
+{
+	struct ugci_replay *rp = dev->priv;
+	const struct ugci_rec_batch *batch = replay_cur(rp);
+	struct itimerspec its;
+	unsigned long long due;
+	uint64_t cnt;
+
+	if (!rp->realtime) {
+		/* Readable for as long as there is something left */
+		if (!batch && read(dev->fd, &cnt, sizeof(cnt)) < 0)
+			DPRINT("UGCI: Replay eventfd read failed\n");
+		return;
+	}
+
+	memset(&its, 0, sizeof(its));
+
+	if (batch) {
+		due = replay_start + (batch->time - replay_first);
+		its.it_value.tv_sec = due / 1000000000ULL;
+		its.it_value.tv_nsec = due % 1000000000ULL;
+	}
+
+	/* A due time of zero would disarm it, but can't happen */
+	timerfd_settime(dev->fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/* One more than the highest device in the recording */
+static int replay_nodes(void)
+{
+	const struct ugci_rec_batch *batch;
+	struct replay_index *boards;
+	const char *map;
+	size_t size, pos;
+	int nodes = 0;
+
+	/* Anything a last init left unopened */
+	replay_boards_free();
+
+	if ((map = replay_map(&size)) == NULL)
+		return 0;
+
+	pos = sizeof(struct ugci_rec_header);
+	replay_first = 0;
+
+	for (; (batch = replay_batch(map, size, pos)); pos = replay_next(batch, pos)) {
+		if (!replay_first)
+			replay_first = batch->time;
+
+		if (batch->id >= replay_nboards) {
+			boards = realloc(replay_boards, (batch->id + 1) * sizeof(*boards));
+			if (boards == NULL)
+				break;
+			memset(boards + replay_nboards, 0,
+			       (batch->id + 1 - replay_nboards) * sizeof(*boards));
+			replay_boards = boards;
+			replay_nboards = batch->id + 1;
+		}
+
+		if (replay_index_add(&replay_boards[batch->id], pos))
+			break;
+	}
+
+	/* Short of memory, we replay the part we have */
+	nodes = replay_nboards;
+
+	munmap((void *)map, size);
+
+	replay_start = ugci_now();
+
+	return nodes;
+}
+
+static int replay_open(struct ugci_dev_info *dev, int index, char *name, int len)
+{
+	struct replay_index *idx;
+	struct ugci_replay *rp;
+	int fd;
+
+	if ((rp = calloc(1, sizeof(*rp))) == NULL)
+		return -1;
+
+	if (index >= replay_nboards || (rp->map = replay_map(&rp->size)) == NULL) {
+		free(rp);
+		return -1;
+	}
+
+	/* In case the file was cut short since nodes() looked at it */
+	idx = &replay_boards[index];
+	if (idx->len && !replay_batch(rp->map, rp->size, idx->off[idx->len - 1])) {
+		munmap((void *)rp->map, rp->size);
+		free(rp);
+		return -1;
+	}
+
+	rp->index = index;
+	rp->realtime = replay_realtime;
+
+	if (rp->realtime)
+		fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	else
+		fd = eventfd(1, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	if (fd < 0) {
+		munmap((void *)rp->map, rp->size);
+		free(rp);
+		return -1;
+	}
+
+	dev->priv = rp;
+	dev->fd = fd;
+
+	rp->batches = *idx;
+	memset(idx, 0, sizeof(*idx));
+	replay_arm(dev);
+
+	snprintf(dev->path, sizeof(dev->path), "replay%d", index);
+	snprintf(dev->phys, sizeof(dev->phys), "replay%d", index);
+	dev->busnum = 0;
+	dev->devnum = index + 1;
+	snprintf(name, len, "Happ Controls UGCI (replay)");
+
+	return fd;
+}
+
+static void replay_close(struct ugci_dev_info *dev)
+{
+	struct ugci_replay *rp = dev->priv;
+
+	close(dev->fd);
+	munmap((void *)rp->map, rp->size);
+	free(rp->batches.off);
+	free(rp);
+	dev->priv = NULL;
+}
+
+static inline int replay_same(const struct hiddev_usage_ref *a, const struct hiddev_usage_ref *b)
+{
+	return a->report_type == b->report_type && a->report_id == b->report_id &&
+		a->field_index == b->field_index && a->usage_index == b->usage_index;
+}
+
+static void replay_remember(struct ugci_replay *rp, const struct hiddev_usage_ref *ev)
+{
+	int i;
+
+	if (ev->field_index == HID_FIELD_INDEX_NONE)
+		return;
+
+	for (i = 0; i < rp->nvalues; i++) {
+		if (replay_same(&rp->values[i], ev))
+			break;
+	}
+
+	if (i == REPLAY_VALUES)
+		return;
+	if (i == rp->nvalues)
+		rp->nvalues++;
+
+	rp->values[i] = *ev;
+}
+
+/* Whatever the recording last said, and zero for anything it didn't. That
+ * covers the coin counters and buttons. The security block and EEPROM were
+ * never recorded, so they read as all zero. */
+static int replay_get_usages(struct ugci_dev_info *dev,
+			     struct hiddev_usage_ref_multi *uref_multi)
+{
+	struct ugci_replay *rp = dev->priv;
+	struct hiddev_usage_ref ref = uref_multi->uref;
+	int i, t;
+
+	for (i = 0; i < uref_multi->num_values; i++) {
+		ref.usage_index = uref_multi->uref.usage_index + i;
+		uref_multi->values[i] = 0;
+
+		for (t = 0; t < rp->nvalues; t++) {
+			if (replay_same(&rp->values[t], &ref)) {
+				uref_multi->values[i] = rp->values[t].value;
+				break;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/* Output goes nowhere */
+static int replay_set_usages(struct ugci_dev_info *dev,
+			     struct hiddev_usage_ref_multi *uref_multi)
+{
+	return 0;
+}
+
+static int replay_set_report(struct ugci_dev_info *dev,
+			     struct hiddev_report_info *rinfo)
+{
+	return 0;
+}
+
+static ssize_t replay_read(struct ugci_dev_info *dev,
+			   struct hiddev_usage_ref *ev, size_t len)
+{
+	struct ugci_replay *rp = dev->priv;
+	const struct ugci_rec_batch *batch;
+	const struct hiddev_usage_ref *refs;
+	size_t n = 0, max = len / sizeof(*ev);
+	unsigned long long now = 0;
+	uint64_t exp;
+	int i;
+
+	if (rp->realtime) {
+		if (read(dev->fd, &exp, sizeof(exp)) < 0 && errno != EAGAIN)
+			DPRINT("UGCI: Replay timer read failed\n");
+		now = ugci_now();
+	}
+
+	/* Only whole batches, just like the reads they came from. One
+	 * bigger than the buffer can't be, so we stop rather than hand
+	 * back part of it. */
+	while ((batch = replay_cur(rp))) {
+		if (batch->count > max) {
+			fprintf(stderr, "UGCI: Replay batch of %u usage refs is bigger "
+				"than a read of %zu, see ugci_set_read_buffer()\n",
+				batch->count, max);
+			rp->next = rp->batches.len;
+			errno = EMSGSIZE;
+			return -1;
+		}
+		if (n && n + batch->count > max)
+			break;
+		if (rp->realtime && replay_start + (batch->time - replay_first) > now)
+			break;
+
+		refs = (const struct hiddev_usage_ref *)(batch + 1);
+		for (i = 0; i < batch->count; i++, n++) {
+			ev[n] = refs[i];
+			replay_remember(rp, &refs[i]);
+		}
+
+		rp->next++;
+	}
+
+	replay_arm(dev);
+
+	if (!n) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	return n * sizeof(*ev);
+}
+
+const struct ugci_backend ugci_replay_backend = {
+	.name		= "replay",
+	.nodes		= replay_nodes,
+	.open		= replay_open,
+	.close		= replay_close,
+	.get_usages	= replay_get_usages,
+	.set_usages	= replay_set_usages,
+	.set_report	= replay_set_report,
+	.read		= replay_read,
+};
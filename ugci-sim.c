@@ -0,0 +1,365 @@
+/*
+ * Copyright (C) 2006 Ben Collins <bcollins@ubuntu.com>
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/* A software UGCI. Each simulated board is backed by a timerfd that ticks
+ * at the configured event rate, so it can be polled just like a hiddev
+ * node. Every tick turns into one input usage (plus the report marker that
+ * hiddev sends with HIDDEV_FLAG_REPORT) when the device is read. Ticks
+ * fall on whole multiples of the period on CLOCK_MONOTONIC, so how long
+ * after its tick an event arrived can be worked out from the clock.
+ *
+ * ugci_sim_unplug() pulls a board out: its timer fires straight away, and
+ * the read fails just like it does for a hiddev node that has gone. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <string.h>
+#include <pthread.h>
+#include <errno.h>
+#include <stdint.h>
+
+#include <linux/types.h>
+#include <linux/hiddev.h>
+
+#include "ugci.h"
+#include "ugci-private.h"
+
+/* Below this the timer is kept at this period and each tick generates
+ * more than one event */
+#define SIM_MIN_PERIOD_NS	10000ULL
+
+/* Play press/release for each player, then a coin for each */
+#define SIM_CYCLE		6
+
+struct ugci_sim {
+	unsigned long long backlog;
+	unsigned int burst;
+	unsigned int step;
+
+	unsigned short coins[2];
+	int play[2];
+
+	unsigned char secblk[UGCI_SEC_VALUES];
+	unsigned char eeprom[504];
+
+	/* Output usages waiting for their report to be committed */
+	unsigned int pending[UGCI_UREFS_MAX][7];
+
+	unsigned int wd_action;
+	unsigned int wd_timeout;
+	unsigned int kbd[2];
+
+	int index;
+	int fd;
+	int gone;
+	struct ugci_sim *next;
+};
+
+static int sim_boards = 1;
+static unsigned int sim_rate;
+
+/* Every open board, for ugci_sim_unplug() */
+static pthread_mutex_t sim_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct ugci_sim *sim_open_list;
+
+int ugci_sim_config(int boards, unsigned int rate)
+{
+	if (boards < 0)
+		return -1;
+
+	sim_boards = boards;
+	sim_rate = rate;
+
+	return 0;
+}
+
+int ugci_sim_unplug(int board)
+{
+	struct itimerspec its;
+	struct ugci_sim *sim;
+	int ret = -1;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_nsec = 1;
+
+	pthread_mutex_lock(&sim_lock);
+
+	for (sim = sim_open_list; sim; sim = sim->next) {
+		if (sim->index != board || sim->gone)
+			continue;
+
+		__atomic_store_n(&sim->gone, 1, __ATOMIC_RELEASE);
+		timerfd_settime(sim->fd, 0, &its, NULL);
+		ret = 0;
+	}
+
+	pthread_mutex_unlock(&sim_lock);
+
+	return ret;
+}
+
+static int sim_nodes(void)
+{
+	return sim_boards;
+}
+
+static int sim_open(struct ugci_dev_info *dev, int index, char *name, int len)
+{
+	struct ugci_sim *sim;
+	struct itimerspec its;
+	struct timespec ts;
+	unsigned long long period, first;
+	int fd, i;
+
+	if (index >= sim_boards)
+		return -1;
+
+	if ((fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0)
+		return -1;
+
+	if ((sim = calloc(1, sizeof(*sim))) == NULL) {
+		close(fd);
+		return -1;
+	}
+
+	memset(&its, 0, sizeof(its));
+	sim->burst = 1;
+
+	if (sim_rate) {
+		period = 1000000000ULL / sim_rate;
+		if (period < SIM_MIN_PERIOD_NS) {
+			sim->burst = sim_rate / (1000000000ULL / SIM_MIN_PERIOD_NS);
+			period = SIM_MIN_PERIOD_NS;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		first = ((ts.tv_sec * 1000000000ULL + ts.tv_nsec) / period + 1) * period;
+
+		its.it_interval.tv_sec = period / 1000000000ULL;
+		its.it_interval.tv_nsec = period % 1000000000ULL;
+		its.it_value.tv_sec = first / 1000000000ULL;
+		its.it_value.tv_nsec = first % 1000000000ULL;
+	}
+
+	if (timerfd_settime(fd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+		free(sim);
+		close(fd);
+		return -1;
+	}
+
+	snprintf((char *)sim->secblk, sizeof(sim->secblk), "SIMUGCI%04d", index % 10000);
+
+	/* Key mapping disabled, 512 byte EEPROM, surface mount board */
+	sim->eeprom[0] = 0x06;
+	for (i = 1; i < sizeof(sim->eeprom); i++)
+		sim->eeprom[i] = i & 0xff;
+
+	sim->index = index;
+	sim->fd = fd;
+
+	pthread_mutex_lock(&sim_lock);
+	sim->next = sim_open_list;
+	sim_open_list = sim;
+	pthread_mutex_unlock(&sim_lock);
+
+	dev->priv = sim;
+	snprintf(dev->path, sizeof(dev->path), "sim%d", index);
+	snprintf(dev->phys, sizeof(dev->phys), "sim%d", index);
+	dev->busnum = 0;
+	dev->devnum = index + 1;
+	snprintf(name, len, "Happ Controls Simulated UGCI");
+
+	return fd;
+}
+
+static void sim_close(struct ugci_dev_info *dev)
+{
+	struct ugci_sim **p;
+
+	pthread_mutex_lock(&sim_lock);
+	for (p = &sim_open_list; *p; p = &(*p)->next) {
+		if (*p == dev->priv) {
+			*p = (*p)->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&sim_lock);
+
+	close(dev->fd);
+	free(dev->priv);
+	dev->priv = NULL;
+}
+
+static int sim_get_usages(struct ugci_dev_info *dev,
+			  struct hiddev_usage_ref_multi *uref_multi)
+{
+	struct ugci_sim *sim = dev->priv;
+	int i, type = ugci_find_uref(&uref_multi->uref);
+
+	switch (type) {
+		case UGCI_UREF_P1_COIN:
+		case UGCI_UREF_P2_COIN:
+			uref_multi->values[0] = sim->coins[type == UGCI_UREF_P2_COIN];
+			break;
+		case UGCI_UREF_P1_PLAY:
+		case UGCI_UREF_P2_PLAY:
+			uref_multi->values[0] = sim->play[type == UGCI_UREF_P2_PLAY];
+			break;
+		case UGCI_UREF_SERIAL_READ_1:
+		case UGCI_UREF_SERIAL_READ_2:
+			for (i = 0; i < 7 && i < uref_multi->num_values; i++)
+				uref_multi->values[i] =
+					sim->secblk[i + (type == UGCI_UREF_SERIAL_READ_2 ? 7 : 0)];
+			break;
+		case UGCI_UREF_EEPROM_READ:
+			for (i = 0; i < sizeof(sim->eeprom) && i < uref_multi->num_values; i++)
+				uref_multi->values[i] = sim->eeprom[i];
+			break;
+		default:
+			errno = EINVAL;
+			return -1;
+	}
+
+	return 0;
+}
+
+static int sim_set_usages(struct ugci_dev_info *dev,
+			  struct hiddev_usage_ref_multi *uref_multi)
+{
+	struct ugci_sim *sim = dev->priv;
+	int i, type = ugci_find_uref(&uref_multi->uref);
+
+	if (type < 0 || uref_multi->uref.report_type != HID_REPORT_TYPE_OUTPUT) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (i = 0; i < 7 && i < uref_multi->num_values; i++)
+		sim->pending[type][i] = uref_multi->values[i];
+
+	return 0;
+}
+
+static int sim_set_report(struct ugci_dev_info *dev,
+			  struct hiddev_report_info *rinfo)
+{
+	struct ugci_sim *sim = dev->priv;
+	struct hiddev_usage_ref_multi uref_multi;
+	int type, i;
+
+	for (type = 0; type < UGCI_UREFS_MAX; type++) {
+		ugci_fill_uref(type, &uref_multi);
+
+		if (uref_multi.uref.report_type != rinfo->report_type ||
+		    uref_multi.uref.report_id != rinfo->report_id)
+			continue;
+
+		switch (type) {
+			case UGCI_UREF_SERIAL_WRITE_1:
+			case UGCI_UREF_SERIAL_WRITE_2:
+				for (i = 0; i < 7; i++)
+					sim->secblk[i + (type == UGCI_UREF_SERIAL_WRITE_2 ? 7 : 0)] =
+						sim->pending[type][i] & 0xff;
+				break;
+			case UGCI_UREF_WD_ACTION:
+				sim->wd_action = sim->pending[type][0];
+				break;
+			case UGCI_UREF_WD_TIMEOUT:
+				sim->wd_timeout = sim->pending[type][0];
+				break;
+			case UGCI_UREF_KBD_MODE:
+				sim->kbd[0] = sim->pending[type][0];
+				sim->kbd[1] = sim->pending[type][1];
+				break;
+		}
+	}
+
+	return 0;
+}
+
+/* Generate the next input usage in the cycle, followed by its report */
+static void sim_generate(struct ugci_sim *sim, struct hiddev_usage_ref *ev)
+{
+	int step = sim->step++ % SIM_CYCLE;
+	int player = (step < 4) ? step / 2 : step - 4;
+
+	memset(ev, 0, 2 * sizeof(*ev));
+
+	ev[0].report_type = HID_REPORT_TYPE_INPUT;
+	ev[0].report_id = player ? UGCI_PLAYER_2_REPORT : UGCI_PLAYER_1_REPORT;
+
+	if (step < 4) {
+		sim->play[player] = !(step & 1);
+		ev[0].field_index = 1;
+		ev[0].usage_code = UGCI_PLAYER_UCODE_PLAY;
+		ev[0].value = sim->play[player];
+	} else {
+		sim->coins[player]++;
+		ev[0].field_index = 0;
+		ev[0].usage_code = UGCI_PLAYER_UCODE_COIN;
+		ev[0].value = sim->coins[player];
+	}
+
+	ev[1].report_type = HID_REPORT_TYPE_INPUT;
+	ev[1].report_id = ev[0].report_id;
+	ev[1].field_index = HID_FIELD_INDEX_NONE;
+}
+
+static ssize_t sim_read(struct ugci_dev_info *dev,
+			struct hiddev_usage_ref *ev, size_t len)
+{
+	struct ugci_sim *sim = dev->priv;
+	uint64_t exp;
+	size_t n = 0, max = len / sizeof(*ev);
+
+	if (__atomic_load_n(&sim->gone, __ATOMIC_ACQUIRE)) {
+		errno = ENODEV;
+		return -1;
+	}
+
+	if (read(dev->fd, &exp, sizeof(exp)) == sizeof(exp))
+		sim->backlog += exp * sim->burst;
+
+	/* Anything that doesn't fit is sent on the next tick */
+	while (sim->backlog && n + 2 <= max) {
+		sim_generate(sim, &ev[n]);
+		sim->backlog--;
+		n += 2;
+	}
+
+	if (!n) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	return n * sizeof(*ev);
+}
+
+const struct ugci_backend ugci_sim_backend = {
+	.name		= "sim",
+	.nodes		= sim_nodes,
+	.open		= sim_open,
+	.close		= sim_close,
+	.get_usages	= sim_get_usages,
+	.set_usages	= sim_set_usages,
+	.set_report	= sim_set_report,
+	.read		= sim_read,
+};
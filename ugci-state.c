@@ -0,0 +1,178 @@
+/*
+ * Copyright (C) 2006 Ben Collins <bcollins@ubuntu.com>
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/* The live input state table, see ugci_get_state(). It is kept up to date
+ * wherever events are decoded, and published with a sequence lock: the
+ * writer makes the sequence odd, changes what it needs to and makes it even
+ * again, and a reader just copies the table and tries again if the
+ * sequence was odd or moved under it. Readers never take a lock or make a
+ * syscall, and cannot hold up the writer.
+ *
+ * Writers still serialize on state_lock, since the reader thread, a poll
+ * and a board being attached can all want to change it. The table is grown
+ * by replacing it, and the old one is kept until the context is freed,
+ * because a reader may still be copying from it. Each replacement is twice
+ * the size, so that is never more than the table itself again. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <linux/types.h>
+#include <linux/hiddev.h>
+
+#include "ugci.h"
+#include "ugci-private.h"
+
+/* Returns the table to change, by player ID */
+struct ugci_player_state *ugci_state_begin(struct ugci_ctx *ctx)
+{
+	pthread_mutex_lock(&ctx->state_lock);
+
+	__atomic_store_n(&ctx->state_seq, ctx->state_seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	return ctx->state ? ctx->state->player : NULL;
+}
+
+void ugci_state_end(struct ugci_ctx *ctx)
+{
+	__atomic_store_n(&ctx->state_seq, ctx->state_seq + 1, __ATOMIC_RELEASE);
+
+	pthread_mutex_unlock(&ctx->state_lock);
+}
+
+/* Make room for this many players. Called with devs_lock held, so that
+ * the table is never smaller than the device table. */
+int ugci_state_reserve(struct ugci_ctx *ctx, int players)
+{
+	struct ugci_state_table *tbl, *old;
+	int size, ret = 0;
+
+	ugci_state_begin(ctx);
+
+	old = ctx->state;
+
+	if (!old || players > old->size) {
+		size = old ? old->size * 2 : UGCI_DEVS_INIT * 2;
+		while (size < players)
+			size *= 2;
+
+		tbl = calloc(1, sizeof(*tbl) + size * sizeof(tbl->player[0]));
+		if (!tbl) {
+			ret = -1;
+			goto out;
+		}
+
+		if (old)
+			memcpy(tbl->player, old->player,
+			       ctx->state_players * sizeof(tbl->player[0]));
+
+		tbl->size = size;
+		tbl->old = old;
+
+		__atomic_store_n(&ctx->state, tbl, __ATOMIC_RELEASE);
+	}
+
+	if (players > ctx->state_players)
+		__atomic_store_n(&ctx->state_players, players, __ATOMIC_RELAXED);
+
+out:
+	ugci_state_end(ctx);
+
+	return ret;
+}
+
+void ugci_state_free(struct ugci_ctx *ctx)
+{
+	struct ugci_state_table *tbl, *old;
+
+	for (tbl = ctx->state; tbl; tbl = old) {
+		old = tbl->old;
+		free(tbl);
+	}
+
+	ctx->state = NULL;
+	ctx->state_players = 0;
+}
+
+/* Both players on a board coming or going. What the board has now is
+ * used as a starting point on attach (state may be NULL if it could not be
+ * read). On removal the play and joystick buttons are let go, so a game
+ * does not see one stuck down. Called with the device locked. */
+void ugci_state_board(struct ugci_dev_info *dev, const struct ugci_board_state *state)
+{
+	struct ugci_ctx *ctx = dev->ctx;
+	struct ugci_player_state *ps;
+	int t;
+
+	ps = ugci_state_begin(ctx) + dev->id * 2;
+
+	for (t = 0; t < 2; t++, ps++) {
+		UGCI_STATE_SET(ps, present, dev->fd >= 0);
+		UGCI_STATE_SET(ps, play, state ? state->play[t] : 0);
+		UGCI_STATE_SET(ps, buttons, 0);
+		if (state)
+			UGCI_STATE_SET(ps, coins, state->coins[t]);
+	}
+
+	ugci_state_end(ctx);
+}
+
+static void state_copy(struct ugci_player_state *out, const struct ugci_player_state *ps)
+{
+	out->coins = __atomic_load_n(&ps->coins, __ATOMIC_RELAXED);
+	out->play = __atomic_load_n(&ps->play, __ATOMIC_RELAXED);
+	out->present = __atomic_load_n(&ps->present, __ATOMIC_RELAXED);
+	out->coins_seq = __atomic_load_n(&ps->coins_seq, __ATOMIC_RELAXED);
+	out->play_seq = __atomic_load_n(&ps->play_seq, __ATOMIC_RELAXED);
+	out->present_seq = __atomic_load_n(&ps->present_seq, __ATOMIC_RELAXED);
+	out->axis_x = __atomic_load_n(&ps->axis_x, __ATOMIC_RELAXED);
+	out->axis_y = __atomic_load_n(&ps->axis_y, __ATOMIC_RELAXED);
+	out->buttons = __atomic_load_n(&ps->buttons, __ATOMIC_RELAXED);
+	out->axis_x_seq = __atomic_load_n(&ps->axis_x_seq, __ATOMIC_RELAXED);
+	out->axis_y_seq = __atomic_load_n(&ps->axis_y_seq, __ATOMIC_RELAXED);
+	out->buttons_seq = __atomic_load_n(&ps->buttons_seq, __ATOMIC_RELAXED);
+}
+
+int ugci_ctx_get_state(struct ugci_ctx *ctx, struct ugci_player_state *out, int max)
+{
+	struct ugci_state_table *tbl;
+	unsigned int seq;
+	int i, n;
+
+	do {
+		/* Only odd while a writer is in the middle of it */
+		while ((seq = __atomic_load_n(&ctx->state_seq, __ATOMIC_ACQUIRE)) & 1)
+			sched_yield();
+
+		tbl = __atomic_load_n(&ctx->state, __ATOMIC_ACQUIRE);
+		n = __atomic_load_n(&ctx->state_players, __ATOMIC_RELAXED);
+
+		for (i = 0; tbl && i < n && i < max; i++)
+			state_copy(&out[i], &tbl->player[i]);
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (__atomic_load_n(&ctx->state_seq, __ATOMIC_RELAXED) != seq);
+
+	return n;
+}
@@ -185,6 +185,25 @@ void ugci_fill_uref(enum ugci_report_type type, struct hiddev_usage_ref_multi *u
 	return;
 }
 
+/* Reverse lookup of a uref against the table. Returns the report type, or
+ * -1 if it is not one we know about. */
+int ugci_find_uref(const struct hiddev_usage_ref *uref)
+{
+	int i;
+
+	for (i = 0; i < UGCI_UREFS_MAX; i++) {
+		const struct hiddev_usage_ref *r = &reports[i].uref;
+
+		if (r->report_type == uref->report_type &&
+		    r->report_id == uref->report_id &&
+		    r->field_index == uref->field_index &&
+		    r->usage_code == uref->usage_code)
+			return i;
+	}
+
+	return -1;
+}
+
 int ugci_commit_uref(struct ugci_dev_info *dev, enum ugci_report_type type)
 {
 	const struct ugci_reports *report = &reports[type];
@@ -198,7 +217,7 @@ int ugci_commit_uref(struct ugci_dev_info *dev, enum ugci_report_type type)
 	rinfo.report_id = report->uref.report_id;
 	rinfo.num_fields = 0;
 
-	if (ioctl(dev->fd, HIDIOCSREPORT, &rinfo) < 0)
+	if (dev->be->set_report(dev, &rinfo) < 0)
 		return -1;
 
 	return 0;
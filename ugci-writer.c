@@ -0,0 +1,187 @@
+/*
+ * Copyright (C) 2006 Ben Collins <bcollins@ubuntu.com>
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/* The writer thread, see ugci_start_writer(). Every board has one slot for
+ * each kind of command, and pending slots are chained in the order they
+ * were first queued on one queue for the context. Queuing a command that
+ * is still waiting only changes its values, so it keeps its place and
+ * goes out once with the latest ones.
+ *
+ * The thread sends each command holding only the board's write_lock, so
+ * whoever is reading the board (and holds its device lock) never waits
+ * for a control transfer. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <linux/types.h>
+#include <linux/hiddev.h>
+
+#include "ugci.h"
+#include "ugci-private.h"
+
+/* Returns less than zero if the writer is not running, or is stopping */
+int ugci_writer_queue(struct ugci_dev_info *dev, enum ugci_command type,
+		      const unsigned int *values, int count)
+{
+	struct ugci_ctx *ctx = dev->ctx;
+	struct ugci_cmd *cmd = &dev->cmds[type];
+
+	pthread_mutex_lock(&ctx->writer_lock);
+
+	if (! ctx->writer_running || ctx->writer_stop) {
+		pthread_mutex_unlock(&ctx->writer_lock);
+		return -1;
+	}
+
+	memcpy(cmd->values, values, count * sizeof(*values));
+
+	if (cmd->pending) {
+		UGCI_STAT_ADD(dev->stats.coalesced, 1);
+	} else {
+		cmd->pending = 1;
+		cmd->queued = ugci_now();
+		cmd->next = NULL;
+
+		if (ctx->cmd_tail)
+			ctx->cmd_tail->next = cmd;
+		else
+			ctx->cmd_head = cmd;
+		ctx->cmd_tail = cmd;
+
+		pthread_cond_signal(&ctx->writer_cond);
+	}
+
+	pthread_mutex_unlock(&ctx->writer_lock);
+
+	return 0;
+}
+
+static void *ugci_writer_main(void *arg)
+{
+	struct ugci_ctx *ctx = arg;
+	unsigned int values[UGCI_SEC_VALUES];
+	unsigned long long queued;
+	ugci_command_callback_t cb;
+	struct ugci_dev_info *dev;
+	struct ugci_cmd *cmd;
+	void *data;
+	int status;
+
+	pthread_mutex_lock(&ctx->writer_lock);
+
+	/* Stopping only means nothing new, whatever is queued still goes */
+	while ((cmd = ctx->cmd_head) || ! ctx->writer_stop) {
+		if (!cmd) {
+			pthread_cond_wait(&ctx->writer_cond, &ctx->writer_lock);
+			continue;
+		}
+
+		if (!(ctx->cmd_head = cmd->next))
+			ctx->cmd_tail = NULL;
+		cmd->pending = 0;
+
+		/* It can be queued again as soon as the lock is dropped */
+		memcpy(values, cmd->values, sizeof(values));
+		queued = cmd->queued;
+		cb = ctx->cmd_cb;
+		data = ctx->cmd_cb_data;
+		dev = cmd->dev;
+
+		pthread_mutex_unlock(&ctx->writer_lock);
+
+		/* The board may have gone away since it was queued */
+		pthread_mutex_lock(&dev->write_lock);
+		status = dev->fd >= 0 ? ugci_cmd_send(dev, cmd->type, values) : -1;
+
+		UGCI_STAT_ADD(dev->stats.commands, 1);
+		if (!status && cmd->type == UGCI_CMD_WD_RUNTIME)
+			UGCI_STAT_ADD(dev->stats.wd_refreshes, 1);
+		ugci_stat_hist(dev->stats.command_latency, ugci_now() - queued);
+
+		pthread_mutex_unlock(&dev->write_lock);
+
+		if (status)
+			DPRINT("UGCI(%d): Command %d failed\n", dev->id, cmd->type);
+
+		if (cb)
+			cb(dev->id, cmd->type, status, data);
+
+		pthread_mutex_lock(&ctx->writer_lock);
+	}
+
+	pthread_mutex_unlock(&ctx->writer_lock);
+
+	return NULL;
+}
+
+int ugci_ctx_start_writer(struct ugci_ctx *ctx)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&ctx->writer_lock);
+
+	if (! ctx->initialized || ctx->writer_running) {
+		ret = -1;
+	} else {
+		ctx->writer_stop = 0;
+		if (pthread_create(&ctx->writer_thread, NULL, ugci_writer_main, ctx))
+			ret = -1;
+		else
+			__atomic_store_n(&ctx->writer_running, 1, __ATOMIC_RELAXED);
+	}
+
+	pthread_mutex_unlock(&ctx->writer_lock);
+
+	return ret;
+}
+
+void ugci_ctx_stop_writer(struct ugci_ctx *ctx)
+{
+	pthread_mutex_lock(&ctx->writer_lock);
+
+	/* Whoever got here first does the join */
+	if (! ctx->writer_running || ctx->writer_stop) {
+		pthread_mutex_unlock(&ctx->writer_lock);
+		return;
+	}
+
+	ctx->writer_stop = 1;
+	pthread_cond_signal(&ctx->writer_cond);
+
+	pthread_mutex_unlock(&ctx->writer_lock);
+
+	pthread_join(ctx->writer_thread, NULL);
+
+	pthread_mutex_lock(&ctx->writer_lock);
+	__atomic_store_n(&ctx->writer_running, 0, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&ctx->writer_lock);
+}
+
+void ugci_ctx_set_command_callback(struct ugci_ctx *ctx, ugci_command_callback_t cb, void *data)
+{
+	pthread_mutex_lock(&ctx->writer_lock);
+	ctx->cmd_cb = cb;
+	ctx->cmd_cb_data = data;
+	pthread_mutex_unlock(&ctx->writer_lock);
+}
@@ -19,15 +19,19 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <sys/types.h>
-#include <sys/stat.h>
-#include <fcntl.h>
 #include <poll.h>
-#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <pthread.h>
 #include <errno.h>
 #include <string.h>
-#include <sys/time.h>
 #include <time.h>
-#include <errno.h>
+#include <stdint.h>
+#include <sched.h>
+#include <sys/mman.h>
 
 #include <linux/types.h>
 #include <linux/hiddev.h>
@@ -36,549 +40,2845 @@
 #include "ugci-private.h"
 
 
-const char *ugci_event_to_name[] = { "unknown", "coin", "play" };
+const char *ugci_event_to_name[] = { "unknown", "coin", "play", "wd", "device",
+	"x axis", "y axis", "button 1", "button 2", "button 3", "button 4",
+	"button 5", "button 6", "button 7" };
+
+/* Defaults for ugci_set_read_buffer() */
+#define UGCI_READ_UREFS		64
+#define UGCI_READ_BUDGET	4
+
+/* How many ready fds we take from the kernel at a time. The event queue
+ * is sized to fit what they can all read, see ugci_read_setup(). */
+#define UGCI_EPOLL_BATCH	8
+
+/* Most events one device can queue from one wakeup. Each usage ref can
+ * queue at most two. */
+#define UGCI_DEV_EVENTS(ctx)	((ctx)->read_urefs * (ctx)->read_budget * 2)
 
-static struct ugci_dev_info devs[UGCI_MAX_DEVS];
+/* Threaded mode, see ugci_start_reader() */
+struct ugci_ring {
+	unsigned int head __attribute__((aligned(64)));	/* Consumer */
+	unsigned int tail __attribute__((aligned(64)));	/* Producer */
+	unsigned int size;
+	unsigned int high_water;
+	unsigned long long pushed;
+	unsigned long long overflows;
 
-static const char *dev_names[UGCI_MAX_DEVS] = { "1/2", "3/4", "5/6", "7/8" };
+	/* Set while on the ready or drain list, so it is only on once */
+	int queued;
+	struct ugci_ring *next;
 
-static const char *dev_path_fmts[] = {
-	"/dev/hiddev%d",
-	"/dev/usb/hiddev%d",
-	"/dev/usb/hid/hiddev%d",
-	NULL,
+	struct ugci_event ev[];
 };
 
-static int hiddev_ok = 1;
-static int hiddev_ver_shown;
-static int initialized;
-static int info_out;
-static int ugci_event_mask;
-static int sim_coin_wait;
+static void ugci_queue_event(struct ugci_dev_info *dev, int id,
+			     enum ugci_event_type type, int value,
+			     unsigned long long time);
+static int ugci_eeprom_join(struct ugci_ctx *ctx, int wait);
+static int __ugci_get_snapshot(struct ugci_dev_info *dev, struct ugci_board_state *state);
 
-static ugci_callback_t ugci_cb;
 
-static struct ugci_dev_info *get_dev_info(int id)
+static void ugci_ctx_setup(struct ugci_ctx *ctx)
 {
-	if (id >= UGCI_MAX_DEVS)
-		return NULL;
+	memset(ctx, 0, sizeof(*ctx));
+
+	ctx->backend = &ugci_hiddev_backend;
+	ctx->hiddev_ok = 1;
+	ctx->epfd = -1;
+	ctx->reader_wake_fd = -1;
+	ctx->reader_notify_fd = -1;
+	ctx->ll_cpu = -1;
+	ctx->reader_wake_watch.type = UGCI_WATCH_WAKE;
+	ctx->hotplug_fd = -1;
+	ctx->bus_fd = -1;
+	ctx->hotplug_watch.type = UGCI_WATCH_HOTPLUG;
+	ctx->read_urefs = UGCI_READ_UREFS;
+	ctx->read_budget = UGCI_READ_BUDGET;
+
+	pthread_mutex_init(&ctx->poll_lock, NULL);
+	pthread_mutex_init(&ctx->devs_lock, NULL);
+	pthread_mutex_init(&ctx->cache_lock, NULL);
+	pthread_mutex_init(&ctx->state_lock, NULL);
+	pthread_mutex_init(&ctx->record_lock, NULL);
+	pthread_mutex_init(&ctx->writer_lock, NULL);
+	pthread_cond_init(&ctx->writer_cond, NULL);
+}
 
-	if (devs[id].fd < 0)
-		return NULL;
+struct ugci_ctx *ugci_ctx_new(void)
+{
+	struct ugci_ctx *ctx = malloc(sizeof(*ctx));
 
-	return &devs[id];
+	if (ctx)
+		ugci_ctx_setup(ctx);
+
+	return ctx;
 }
 
-/* Checks a device for UGCI signatures */
-static int is_happ_ugci(int fd)
+void ugci_ctx_free(struct ugci_ctx *ctx)
 {
-	int i = 0, ret;
-	struct hiddev_devinfo dinfo;
-	unsigned int version;
-
-	while ((ret = ioctl(fd, HIDIOCAPPLICATION, i)) > 0 && ret != UGCI_PLAYER_APP)
-		i++;
+	int i;
 
-	if (ret != UGCI_PLAYER_APP)
-		return 0;
+	if (!ctx)
+		return;
 
-	ioctl(fd, HIDIOCGDEVINFO, &dinfo);
-	if (dinfo.vendor != USB_VENDOR_ID_HAPP)
-		return 0;
+	ugci_ctx_close(ctx);
 
-	ioctl(fd, HIDIOCGVERSION, &version);
-	if (version < MIN_HID_VERSION) {
-		fprintf(stderr, "  HID Version is %d.%d.%d. Need a "
-			"minimum of %d.%d.%d.\n",
-			version >> 16, (version >> 8) & 0xff, version & 0xff,
-			MIN_HID_VERSION >> 16, (MIN_HID_VERSION >> 8) & 0xff,
-			MIN_HID_VERSION & 0xff);
-		hiddev_ok = 0;
-		return 0;
+	for (i = 0; i < ctx->ndevs; i++) {
+		pthread_mutex_destroy(&ctx->devs[i]->write_lock);
+		pthread_mutex_destroy(&ctx->devs[i]->lock);
+		free(ctx->devs[i]);
 	}
+	free(ctx->devs);
+	free(ctx->stat_devs);
+	free(ctx->pfd);
+	free(ctx->pdev);
+	free(ctx->read_buf);
+	free(ctx->evq);
+
+	ugci_cache_free(ctx);
+	free(ctx->cache_path);
+
+	ugci_state_free(ctx);
+
+	pthread_cond_destroy(&ctx->writer_cond);
+	pthread_mutex_destroy(&ctx->writer_lock);
+	pthread_mutex_destroy(&ctx->record_lock);
+	pthread_mutex_destroy(&ctx->state_lock);
+	pthread_mutex_destroy(&ctx->cache_lock);
+	pthread_mutex_destroy(&ctx->devs_lock);
+	pthread_mutex_destroy(&ctx->poll_lock);
+
+	free(ctx);
+}
 
-	if (info_out && ! hiddev_ver_shown++)
-		printf("  HID device driver version is %d.%d.%d\n",
-			version >> 16, (version >> 8) & 0xff, version & 0xff);
+/* Slot for a device ID, whether there is a device in it or not */
+static struct ugci_dev_info *ugci_get_slot(struct ugci_ctx *ctx, int id)
+{
+	struct ugci_dev_info *dev = NULL;
 
-	if (info_out)
-		printf("  HID Bus(%d) DevNum(%d) IFNum(%d)\n",
-			dinfo.busnum, dinfo.devnum, dinfo.ifnum);
+	pthread_mutex_lock(&ctx->devs_lock);
+	if (id >= 0 && id < ctx->ndevs)
+		dev = ctx->devs[id];
+	pthread_mutex_unlock(&ctx->devs_lock);
 
-	return 1;
+	return dev;
 }
 
-
-int ugci_init (ugci_callback_t cb, unsigned int mask, int info)
+/* Returns the device locked, or NULL if there is none */
+static struct ugci_dev_info *ugci_lock_dev(struct ugci_ctx *ctx, int id)
 {
-	int i, id;
+	struct ugci_dev_info *dev;
 
-	if (info) {
-		info_out = 1;
-		printf("UGCI: Version %d.%d.%d initializing...\n",
-			LIBUGCI_VERSION >> 16, (LIBUGCI_VERSION >> 8) & 0xff,
-			LIBUGCI_VERSION & 0xff);
-	}
+	if (!(dev = ugci_get_slot(ctx, id)))
+		return NULL;
 
-	if (info_out) {
-		if (! cb && mask)
-			printf("UGCI: WARNING: Event mask supplied, yet no callback registered.\n");
-		else if (cb && ! mask)
-			printf("UGCI: WARNING: Callback registered, yet no event mask supplied.\n");
+	pthread_mutex_lock(&dev->lock);
+
+	if (dev->fd < 0) {
+		pthread_mutex_unlock(&dev->lock);
+		return NULL;
 	}
 
-	for (id = 0; id < UGCI_MAX_DEVS; id++)
-		devs[id].fd = -1;
+	return dev;
+}
+
+static inline void ugci_unlock_dev(struct ugci_dev_info *dev)
+{
+	pthread_mutex_unlock(&dev->lock);
+}
 
-	for (i = id = 0; i < 8 && id < UGCI_MAX_DEVS && hiddev_ok; i++) {
-		struct hiddev_usage_ref_multi uref_multi;
-		int t, fd = -1;
-		char devname[32];
-		char name[256];
 
-		for (t = 0; dev_path_fmts[t]; t++) {
-			sprintf(devname, dev_path_fmts[t], i);
-			if ((fd = open(devname, O_RDONLY)) >= 0)
-				break;
-		}
+int ugci_ctx_set_cache(struct ugci_ctx *ctx, const char *path)
+{
+	char *copy = NULL;
 
-		if (fd < 0)
-			continue;
+	if (ctx->initialized || (path && !(copy = strdup(path))))
+		return -1;
 
-		if (! is_happ_ugci(fd)) {
-			close(fd);
-			continue;
-		}
+	free(ctx->cache_path);
+	ctx->cache_path = copy;
+
+	return 0;
+}
 
-		/* Ok, so we know we have a legit coin/start device. Let's
-		 * save it for later use. */
-		memset(&devs[id], 0, sizeof(devs[id]));
-		devs[id].fd = fd;
-		devs[id].id = id;
+int ugci_ctx_set_backend(struct ugci_ctx *ctx, int type)
+{
+	if (ctx->initialized)
+		return -1;
 
-		ioctl(fd, HIDIOCGNAME(sizeof(name)), name);
+	ctx->backend_set = 1;
+	ctx->bus_wanted = 0;
+
+	switch (type) {
+		case UGCI_BACKEND_HIDDEV:
+			ctx->backend = &ugci_hiddev_backend;
+			break;
+		case UGCI_BACKEND_SIM:
+			ctx->backend = &ugci_sim_backend;
+			break;
+		case UGCI_BACKEND_REPLAY:
+			ctx->backend = &ugci_replay_backend;
+			break;
+		case UGCI_BACKEND_HIDRAW:
+			ctx->backend = &ugci_hidraw_backend;
+			break;
+		case UGCI_BACKEND_BUS:
+			ctx->bus_wanted = 1;
+			break;
+		default:
+			return -1;
+	}
 
-		/* Enable events */
-		t = HIDDEV_FLAG_UREF | HIDDEV_FLAG_REPORT;
-		ioctl(fd, HIDIOCSFLAG, &t);
+	return 0;
+}
 
-		/* Make sure the reports for the hiddev are initialized */
-		ioctl(fd, HIDIOCINITREPORT, 0);
 
-		if (info_out)
-			printf("    Players %s: %s: %s\n", dev_names[id], devname, name);
+static void ugci_epoll_teardown(struct ugci_ctx *ctx)
+{
+	if (ctx->epfd >= 0) {
+		close(ctx->epfd);
+		ctx->epfd = -1;
+	}
+}
 
-		/* Now, let's get the eeprom. */
-		ugci_fill_uref(UGCI_UREF_EEPROM_READ, &uref_multi);
-		if (ioctl(fd, HIDIOCGUSAGES, &uref_multi) < 0)
-			fprintf(stderr, "UGCI(%d): Error reading eeprom\n", id);
-		else {
-			for (t = 0; t < uref_multi.num_values; t++)
-				devs[id].eeprom[t] = (unsigned char)uref_multi.values[t];
-			if (info_out) {
-				char *leader = "               :";
+static int ugci_epoll_add(struct ugci_ctx *ctx, int fd, struct ugci_watch *watch)
+{
+	struct epoll_event eev = { .events = EPOLLIN, .data.ptr = watch };
 
-				printf("%s Key mapping %sabled\n", leader,
-					devs[id].eeprom[0] & 0x01 ? "en" : "dis");
+	return epoll_ctl(ctx->epfd, EPOLL_CTL_ADD, fd, &eev);
+}
 
-				printf("%s %d byte EEPROM\n", leader,
-					devs[id].eeprom[0] & 0x02 ? 512 : 128);
+static int ugci_epoll_register(struct ugci_dev_info *dev)
+{
+	struct ugci_ctx *ctx = dev->ctx;
 
-				if (devs[id].eeprom[0] & 0x04)
-					printf("%s Surface mount board (rev C)\n", leader);
-				else
-					printf("%s Thru hole board (rev C)\n", leader);
-			}
+	if (ugci_epoll_add(ctx, dev->fd, &dev->input_watch) < 0)
+		return -1;
 
-			devs[id].eeprom_valid = 1;
-			devs[id].eeprom_len = (devs[id].eeprom[0] & 0x02) ? 504 : 120;
-		}
-	
-		id++;
+	if (ugci_epoll_add(ctx, dev->timer_fd, &dev->timer_watch) < 0) {
+		epoll_ctl(ctx->epfd, EPOLL_CTL_DEL, dev->fd, NULL);
+		return -1;
 	}
 
-	if (! hiddev_ok)
+	return 0;
+}
+
+/* Each device has its input and its timer in the set, so the one fd is
+ * enough to know when there is anything for ugci_dispatch() to do. */
+static int ugci_epoll_setup(struct ugci_ctx *ctx)
+{
+	int i;
+
+	if ((ctx->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
 		return -1;
 
-	ugci_cb = cb;
-	ugci_event_mask = mask;
-	initialized = 1;
+	for (i = 0; i < ctx->ndevs; i++) {
+		if (ctx->devs[i]->fd >= 0 && ugci_epoll_register(ctx->devs[i]) < 0) {
+			ugci_epoll_teardown(ctx);
+			return -1;
+		}
+	}
 
-	return id;
+	return 0;
 }
 
 
-static void disable_dev(int id)
+/* Add an empty slot to the end of the table. Called with devs_lock held. */
+static struct ugci_dev_info *ugci_new_slot(struct ugci_ctx *ctx)
 {
-	int i, valid;
-	struct ugci_dev_info *dev = get_dev_info(id);
+	struct ugci_dev_info *dev;
+	pthread_mutexattr_t attr;
+	int t;
 
-	if (!dev)
-		return;
+	if (ctx->ndevs == ctx->devs_size) {
+		int size = ctx->devs_size ? ctx->devs_size * 2 : UGCI_DEVS_INIT;
+		struct ugci_dev_info **devs = realloc(ctx->devs, size * sizeof(*devs));
 
-	close(dev->fd);
+		if (!devs)
+			return NULL;
+
+		ctx->devs = devs;
+		ctx->devs_size = size;
+	}
+
+	if (ugci_state_reserve(ctx, (ctx->ndevs + 1) * 2))
+		return NULL;
+
+	if (!(dev = calloc(1, sizeof(*dev))))
+		return NULL;
+
+	pthread_mutex_init(&dev->lock, NULL);
+	/* The watchdog thread can be real-time, and takes write_lock */
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setprotocol(&attr, PTHREAD_PRIO_INHERIT);
+	pthread_mutex_init(&dev->write_lock, &attr);
+	pthread_mutexattr_destroy(&attr);
 	dev->fd = -1;
+	dev->id = ctx->ndevs;
+
+	for (t = 0; t < UGCI_CMD_MAX; t++) {
+		dev->cmds[t].dev = dev;
+		dev->cmds[t].type = t;
+	}
 
-	for (i = valid = 0; i < UGCI_MAX_DEVS; i++)
-		if (devs[i].fd >= 0)
-			valid++;
+	ctx->devs[ctx->ndevs++] = dev;
 
-	/* If we have no more valid devs, we are basically shutdown */
-	if (!valid)
-		initialized = 0;
+	return dev;
 }
 
-
-void ugci_close(void)
+/* Pick a slot for a newly probed device. A board that comes back on the
+ * same port gets the slot it had before, so its player ids do not move.
+ * Otherwise, slots that were never used are preferred, and the table is
+ * only grown when there are no free ones. */
+static struct ugci_dev_info *ugci_find_slot(struct ugci_ctx *ctx, const char *phys)
 {
+	struct ugci_dev_info *dev = NULL;
 	int i;
 
-	if (! initialized)
-		return;
+	pthread_mutex_lock(&ctx->devs_lock);
 
-	initialized = 0;
+	for (i = 0; !dev && phys[0] && i < ctx->ndevs; i++) {
+		if (ctx->devs[i]->fd < 0 && strcmp(ctx->devs[i]->phys, phys) == 0)
+			dev = ctx->devs[i];
+	}
 
-	if (info_out) {
-		info_out = 0;
-		printf("UGCI: Shutting down\n");
+	for (i = 0; !dev && i < ctx->ndevs; i++) {
+		if (ctx->devs[i]->fd < 0 && !ctx->devs[i]->phys[0])
+			dev = ctx->devs[i];
 	}
 
-	for (i = 0; i < UGCI_MAX_DEVS; i++)
-		disable_dev(i);
-}
+	for (i = 0; !dev && i < ctx->ndevs; i++) {
+		if (ctx->devs[i]->fd < 0)
+			dev = ctx->devs[i];
+	}
 
+	if (!dev)
+		dev = ugci_new_slot(ctx);
 
-int ugci_get_coin_count(int id, unsigned short *count)
+	pthread_mutex_unlock(&ctx->devs_lock);
+
+	return dev;
+}
+
+/* Probe the index'th node of the backend, and if it is a UGCI set it up in
+ * a free slot. Returns the new device, or NULL. */
+static struct ugci_dev_info *ugci_attach(struct ugci_ctx *ctx, int index)
 {
-	struct hiddev_usage_ref_multi uref_multi;
-	struct ugci_dev_info *dev = get_dev_info(id / 2);
-	enum ugci_report_type type = (id & 1) ? UGCI_UREF_P2_COIN :
-		UGCI_UREF_P1_COIN;
+	struct ugci_dev_info probe, *dev;
+	struct ugci_board_state state;
+	const size_t keep = offsetof(struct ugci_dev_info, id);
+	int fd, id;
+	char name[256];
 
-	if (!dev)
-		return -1;
+	memset(&probe, 0, sizeof(probe));
+	probe.ctx = ctx;
+	probe.be = ctx->backend;
 
-	ugci_fill_uref(type, &uref_multi);
+	if ((fd = probe.be->open(&probe, index, name, sizeof(name))) < 0)
+		return NULL;
 
-	if (ioctl(dev->fd, HIDIOCGUSAGES, &uref_multi))
-		return -1;
+	probe.fd = fd;
 
-	/* XXX Not endian safe */
-	*count = uref_multi.values[0];
+	if (!(dev = ugci_find_slot(ctx, probe.phys))) {
+		fprintf(stderr, "UGCI: No free slot for %s\n", probe.path);
+		probe.be->close(&probe);
+		return NULL;
+	}
 
-	return 0;
-}
+	pthread_mutex_lock(&dev->lock);
+	pthread_mutex_lock(&dev->write_lock);
+
+	/* The slot keeps its locks, ring, commands and ID */
+	id = dev->id;
+	memcpy((char *)dev + keep, (char *)&probe + keep, sizeof(*dev) - keep);
+	dev->id = id;
+
+	/* Coin releases and watchdog refreshes are driven off this */
+	dev->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (dev->timer_fd < 0) {
+		fprintf(stderr, "UGCI(%d): Could not create timer\n", id);
+		dev->be->close(dev);
+		dev->fd = -1;
+		pthread_mutex_unlock(&dev->write_lock);
+		pthread_mutex_unlock(&dev->lock);
+		return NULL;
+	}
 
-/* The security buffer (AKA serial buffer) is a 14 byte non-volatile area.
- * It must be read in 2 7-byte reads. */
-int ugci_get_secblk(int id, unsigned char values[UGCI_SEC_VALUES])
-{
-	struct hiddev_usage_ref_multi uref_multi;
-	struct ugci_dev_info *dev = get_dev_info(id);
-	int i;
+	pthread_mutex_unlock(&dev->write_lock);
 
-	if (!dev)
-		return -1;
+	/* Ok, so we know we have a legit coin/start device. Let's save it
+	 * for later use. */
+	dev->input_watch.type = UGCI_WATCH_INPUT;
+	dev->input_watch.dev = dev;
+	dev->timer_watch.type = UGCI_WATCH_TIMER;
+	dev->timer_watch.dev = dev;
 
-	ugci_fill_uref(UGCI_UREF_SERIAL_READ_1, &uref_multi);
+	ctx->active++;
 
-	if (ioctl(dev->fd, HIDIOCGUSAGES, &uref_multi) < 0)
-		return -1;
+	ugci_state_board(dev, __ugci_get_snapshot(dev, &state) ? NULL : &state);
 
-	for (i = 0; i < uref_multi.num_values; i++)
-		values[i] = ((unsigned int)uref_multi.values[i]) & 0xff;
+	if (ctx->info_out)
+		printf("    Players %d/%d: %s: %s\n", id * 2 + 1, id * 2 + 2,
+		       dev->path, name);
 
-	ugci_fill_uref(UGCI_UREF_SERIAL_READ_2, &uref_multi);
+	/* The eeprom is left for ugci_load_eeprom() */
+
+	pthread_mutex_unlock(&dev->lock);
+
+	return dev;
+}
 
-	if (ioctl(dev->fd, HIDIOCGUSAGES, &uref_multi) < 0)
+int ugci_ctx_set_read_buffer(struct ugci_ctx *ctx, int urefs, int budget)
+{
+	if (ctx->initialized || urefs < 0 || budget < 0)
 		return -1;
 
-	for (i = 0; i < 7; i++)
-		values[i + 7] = ((unsigned int)uref_multi.values[i]) & 0xff;
+	ctx->read_urefs = urefs ?: UGCI_READ_UREFS;
+	ctx->read_budget = budget ?: UGCI_READ_BUDGET;
 
 	return 0;
 }
 
-int ugci_set_secblk(int id, unsigned char values[UGCI_SEC_VALUES])
+/* The read buffer, and an event queue that fits a whole epoll batch of
+ * devices reading their full budget */
+static int ugci_read_setup(struct ugci_ctx *ctx)
 {
-	struct hiddev_usage_ref_multi uref_multi;
-	struct ugci_dev_info *dev = get_dev_info(id);
-	int i;
+	struct hiddev_usage_ref *buf;
+	struct ugci_event *evq;
+	unsigned int size = UGCI_EVQ_SIZE;
 
-	if (!dev)
-		return -1;
+	while (size < UGCI_EPOLL_BATCH * (UGCI_DEV_EVENTS(ctx) + 2))
+		size *= 2;
 
-	/* Handle first 7 bytes */
-	ugci_fill_uref(UGCI_UREF_SERIAL_WRITE_1, &uref_multi);
+	if (!(buf = realloc(ctx->read_buf, ctx->read_urefs * sizeof(*buf))))
+		return -1;
+	ctx->read_buf = buf;
+
+	if (size != ctx->evq_size) {
+		if (!(evq = realloc(ctx->evq, size * sizeof(*evq))))
+			return -1;
+		ctx->evq = evq;
+		ctx->evq_size = size;
+		ctx->evq_head = ctx->evq_tail = 0;
+	}
 
-	for (i = 0; i < uref_multi.num_values; i++)
-		uref_multi.values[i] = (unsigned int)values[i];
+	return 0;
+}
 
-	if (ioctl(dev->fd, HIDIOCSUSAGES, &uref_multi) < 0)
-		return -1;
+int ugci_ctx_init(struct ugci_ctx *ctx, ugci_callback_t cb, unsigned int mask, int info)
+{
+	unsigned long long start = ugci_now();
+	int i, id, nodes;
 
-	if (ugci_commit_uref(dev, UGCI_UREF_SERIAL_WRITE_1))
-		return -1;
+	if (info) {
+		ctx->info_out = 1;
+		printf("UGCI: Version %d.%d.%d initializing...\n",
+			LIBUGCI_VERSION >> 16, (LIBUGCI_VERSION >> 8) & 0xff,
+			LIBUGCI_VERSION & 0xff);
+	}
 
+	if (ctx->info_out) {
+		if (! cb && ! ctx->event_cb && mask)
+			printf("UGCI: WARNING: Event mask supplied, yet no callback registered.\n");
+		else if (cb && ! mask)
+			printf("UGCI: WARNING: Callback registered, yet no event mask supplied.\n");
+	}
 
-	/* Now the second half */
-	ugci_fill_uref(UGCI_UREF_SERIAL_WRITE_2, &uref_multi);
+	/* With no backend asked for, a running ugcid has the boards */
+	if (ctx->bus_wanted || ! ctx->backend_set) {
+		if ((id = ugci_bus_attach(ctx, UGCI_BUS_NAME, ! ctx->bus_wanted)) >= 0) {
+			ctx->cb = cb;
+			ctx->event_mask = mask;
+			ctx->initialized = 1;
+			return id;
+		}
 
-	for (i = 0; i < uref_multi.num_values; i++)
-		uref_multi.values[i] = (unsigned int)values[i + 7];
+		if (ctx->bus_wanted)
+			return -1;
+	}
 
-	if (ioctl(dev->fd, HIDIOCSUSAGES, &uref_multi) < 0)
+	if (ugci_read_setup(ctx))
 		return -1;
 
-	if (ugci_commit_uref(dev, UGCI_UREF_SERIAL_WRITE_2))
-		return -1;
+	for (id = 0; id < ctx->ndevs; id++)
+		ctx->devs[id]->phys[0] = '\0';
 
-	/* Reread so caller can easily verify */
-	return ugci_get_secblk(id, values);
-}
+	if (ctx->cache_path && ugci_cache_load(ctx) && ctx->info_out)
+		printf("UGCI: Ignoring unusable cache %s\n", ctx->cache_path);
 
-int ugci_set_watchdog(int id, int type, unsigned short seconds)
-{
-	struct hiddev_usage_ref_multi uref_multi;
-	struct ugci_dev_info *dev = get_dev_info(id);
+	nodes = ctx->backend->nodes();
 
-	if (!dev)
-		return -1;
+	for (i = id = 0; i < nodes && ctx->hiddev_ok; i++) {
+		if (ugci_attach(ctx, i))
+			id++;
+	}
 
-	if (type != UGCI_WD_BOOT && type != UGCI_WD_RUNTIME)
-		return -1;
+	/* hidraw wants a newer kernel, and its nodes may not be readable
+	 * where the hiddev ones are */
+	if (! id && ctx->backend == &ugci_hidraw_backend) {
+		if (ctx->info_out)
+			printf("UGCI: No devices on %d hidraw node%s, trying hiddev\n",
+			       nodes, nodes == 1 ? "" : "s");
 
-	if (info_out) {
-		if (seconds)
-			printf("UGCI(%d): Setting watchdog %s timer for %u second interval\n",
-			       id, type == UGCI_WD_BOOT ? "boot" : "runtime", seconds);
-		else
-			printf("UGCI(%d): Disabling watchdog %s timer\n", id,
-			       type == UGCI_WD_BOOT ? "boot" : "runtime");
-	}
+		ctx->backend = &ugci_hiddev_backend;
+		nodes = ctx->backend->nodes();
 
-	ugci_fill_uref(UGCI_UREF_WD_ACTION, &uref_multi);
-	uref_multi.values[0] = type;
-	if (ioctl(dev->fd, HIDIOCSUSAGES, &uref_multi) < 0)
-		return -1;		
+		for (i = 0; i < nodes && ctx->hiddev_ok; i++) {
+			if (ugci_attach(ctx, i))
+				id++;
+		}
+	}
 
-	ugci_fill_uref(UGCI_UREF_WD_TIMEOUT, &uref_multi);
-	uref_multi.values[0] = (unsigned int)seconds;
-	if (ioctl(dev->fd, HIDIOCSUSAGES, &uref_multi) < 0)
+	if (! ctx->hiddev_ok)
 		return -1;
 
-	/* Write the changes to the device. Both of these are on the same
-	 * report_id, and must be committed together. */
-	if (ugci_commit_uref(dev, UGCI_UREF_WD_ACTION))
-		return -1;
+	if (ctx->info_out)
+		printf("UGCI: Found %d device%s on %d %s node%s in %.2f ms\n",
+		       id, id == 1 ? "" : "s", nodes, ctx->backend->name,
+		       nodes == 1 ? "" : "s", (ugci_now() - start) / 1e6);
 
-	/* Set our interval */
-	if (type == UGCI_WD_RUNTIME) {
-		dev->wd_interval = seconds;
-		dev->last_wd = time(NULL);
-	}
+	/* Register everything we found once. If this fails, we just fall
+	 * back to building a poll(2) set on every call. */
+	if (id)
+		ugci_epoll_setup(ctx);
 
-	return 0;
+	ctx->cb = cb;
+	ctx->event_mask = mask;
+	ctx->initialized = 1;
+
+	return id;
 }
 
 
-int ugci_get_eeprom(int id, unsigned char *data, int *len)
+/* Called with the device locked */
+static void disable_dev(struct ugci_dev_info *dev)
 {
-	struct ugci_dev_info *dev = get_dev_info(id);
+	struct ugci_ctx *ctx = dev->ctx;
 
-	if (!dev || data == NULL || !dev->eeprom_valid)
-		return -1;
+	if (dev->fd < 0)
+		return;
 
-	memcpy(data, dev->eeprom, dev->eeprom_len);
-	*len = dev->eeprom_len;
+	if (ctx->epfd >= 0) {
+		epoll_ctl(ctx->epfd, EPOLL_CTL_DEL, dev->fd, NULL);
+		epoll_ctl(ctx->epfd, EPOLL_CTL_DEL, dev->timer_fd, NULL);
+	}
 
-	return 0;
-}
+	close(dev->timer_fd);
 
-int ugci_kbd_mode(int id, int mode, unsigned char delay)
-{
-	struct hiddev_usage_ref_multi uref_multi;
-	struct ugci_dev_info *dev = get_dev_info(id);
+	/* Waits for the writer thread, if it is sending something */
+	pthread_mutex_lock(&dev->write_lock);
+	dev->be->close(dev);
+	dev->fd = -1;
+	pthread_mutex_unlock(&dev->write_lock);
 
-	if (!dev)
-		return -1;
+	ctx->active--;
 
-	if (mode < UGCI_KBD_NONE || mode > UGCI_KBD_BOOT)
-		return -1;
+	ugci_state_board(dev, NULL);
 
-	if (info_out) {
-		printf("UGCI(%d): Setting keyboard mode to %s (%u delay)\n", id,
-		       mode == UGCI_KBD_NONE ? "NONE" : mode == UGCI_KBD_HID ? "HID" : "BOOT",
-		       delay);
-        }
+	if (ctx->initialized && (ctx->event_mask & UGCI_EVENT_MASK_DEVICE))
+		ugci_queue_event(dev, dev->id * 2, UGCI_EVENT_DEVICE, 0, ugci_now());
 
-	ugci_fill_uref(UGCI_UREF_KBD_MODE, &uref_multi);
-	uref_multi.values[0] = mode;
-	uref_multi.values[0] = delay;
-        if (ioctl(dev->fd, HIDIOCSUSAGES, &uref_multi) < 0)
-                return -1;
+	/* If we have no more valid devs, we are basically shutdown, unless
+	 * we are waiting for new ones to show up */
+	if (!ctx->active)
+		ugci_record_flush(ctx);
 
-	if (ugci_commit_uref(dev, UGCI_UREF_KBD_MODE))
-		return -1;
+	if (!ctx->active && ctx->hotplug_fd < 0) {
+		ctx->initialized = 0;
 
-	return 0;
+		ugci_epoll_teardown(ctx);
+	}
 }
 
-unsigned int ugci_get_version(void)
+
+void ugci_ctx_close(struct ugci_ctx *ctx)
 {
-	return LIBUGCI_VERSION;
-}
+	struct ugci_dev_info *dev;
+	int i;
 
+	ugci_ctx_stop_reader(ctx);
+	ugci_ctx_stop_writer(ctx);
+	ugci_ctx_stop_watchdog(ctx);
+	ugci_eeprom_join(ctx, 1);
 
-void ugci_set_coin_simulate(int wait_time)
-{
-	sim_coin_wait = wait_time;
-}
+	/* Losing the last board already shut the devices down */
+	if (! ctx->initialized)
+		goto done;
 
+	ctx->initialized = 0;
 
-static void ugci_send_event(int id, enum ugci_event_type type, int value)
-{
-	DPRINT("UGCI(%d): Sending Player %d %s button: %d\n",
-	       id / 2, id + 1, ugci_event_to_name[type], value);
+	if (ctx->info_out) {
+		ctx->info_out = 0;
+		printf("UGCI: Shutting down\n");
+	}
 
-	if (ugci_cb)
-		ugci_cb(id, type, value);
+	for (i = 0; (dev = ugci_get_slot(ctx, i)); i++) {
+		pthread_mutex_lock(&dev->lock);
+		disable_dev(dev);
+		pthread_mutex_unlock(&dev->lock);
+	}
+
+	if (ctx->hotplug_fd >= 0) {
+		close(ctx->hotplug_fd);
+		ctx->hotplug_fd = -1;
+	}
+
+	ugci_epoll_teardown(ctx);
+
+done:
+	/* Readers of a bus we publish see it closed, not just quiet */
+	ugci_ctx_publish(ctx, NULL, 0);
+
+	pthread_mutex_lock(&ctx->poll_lock);
+	ugci_bus_detach(ctx);
+	pthread_mutex_unlock(&ctx->poll_lock);
+
+	ugci_ctx_record(ctx, NULL);
+
+	if (ctx->cache_path && ugci_cache_save(ctx))
+		fprintf(stderr, "UGCI: Could not write cache %s\n", ctx->cache_path);
 }
 
 
-static inline unsigned long long ugci_tv_to_msec(struct timeval *tv)
+/* We attempt 2 refreshes per period. The watchdog thread reads these
+ * without the device lock. */
+static inline unsigned long long ugci_wd_due(struct ugci_dev_info *dev)
 {
-	return ((unsigned long long)tv->tv_sec * 1000) + ((unsigned long long)tv->tv_usec / 1000);
-}
+	unsigned int interval = __atomic_load_n(&dev->wd_interval, __ATOMIC_RELAXED);
 
+	/* Half in ns, so that a 1 second watchdog is not due on its deadline */
+	return __atomic_load_n(&dev->last_wd, __ATOMIC_RELAXED) +
+		interval * 500000000ULL;
+}
 
-int ugci_poll(int timeout)
+/* How close a runtime refresh sent at now came to the board giving up,
+ * a whole interval after the one before (prev). Called with write_lock
+ * held. */
+static void ugci_wd_deadline(struct ugci_dev_info *dev, unsigned long long prev,
+			     unsigned int interval, unsigned long long now)
 {
-	int i, fds, events, rd;
-	struct pollfd pfd[UGCI_MAX_DEVS];
-	struct ugci_dev_info *dev;
+	unsigned long long deadline = prev + interval * 1000000000ULL;
+	unsigned long long slack = now < deadline ? deadline - now : 0;
 
-	if (! initialized)
-		return -1;
+	if (!slack)
+		UGCI_STAT_ADD(dev->stats.wd_missed, 1);
+	if (!dev->stats.wd_min_slack || slack < dev->stats.wd_min_slack)
+		__atomic_store_n(&dev->stats.wd_min_slack, slack ?: 1, __ATOMIC_RELAXED);
+}
+
+/* Arm the device's timer for its next coin release or watchdog refresh,
+ * or disarm it if there is none. Called with the device locked. */
+static void ugci_dev_arm(struct ugci_dev_info *dev)
+{
+	struct itimerspec its;
+	unsigned long long due, next = 0;
+	int t, wait = dev->ctx->sim_coin_wait;
 
-	for (i = fds = 0; i < UGCI_MAX_DEVS; i++) {
-		if (!(dev = get_dev_info(i)))
+	for (t = 0; wait && t < 2; t++) {
+		if (! dev->coin_pressed[t])
 			continue;
 
-		pfd[fds].events = POLLIN;
-		pfd[fds].fd = dev->fd;
-		pfd[fds].revents = 0;
+		due = dev->coin_time[t] + wait * 1000000ULL;
+		if (!next || due < next)
+			next = due;
+	}
 
-		fds++;
+	/* The watchdog thread has its own clock */
+	if (dev->wd_interval && ! __atomic_load_n(&dev->ctx->wd_running, __ATOMIC_RELAXED)) {
+		due = ugci_wd_due(dev);
+		if (!next || due < next)
+			next = due;
 	}
 
-	if (! fds)
-		return 0;
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = next / 1000000000ULL;
+	its.it_value.tv_nsec = next % 1000000000ULL;
 
-	rd = poll(pfd, fds, timeout);
+	/* An absolute time in the past fires right away */
+	timerfd_settime(dev->timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
 
-	for (i = events = 0; i < UGCI_MAX_DEVS; i++) {
-		struct hiddev_usage_ref ev[64];
-		int t, p;
 
-		if (!(dev = get_dev_info(i)))
-			continue;
+int ugci_ctx_get_coin_count(struct ugci_ctx *ctx, int id, unsigned short *count)
+{
+	struct hiddev_usage_ref_multi uref_multi;
+	struct ugci_dev_info *dev = ugci_lock_dev(ctx, id / 2);
+	enum ugci_report_type type = (id & 1) ? UGCI_UREF_P2_COIN :
+		UGCI_UREF_P1_COIN;
+	int ret;
 
-		for (p = 0; p < fds; p++)
-			if (pfd[p].fd == dev->fd)
-				break;
+	if (!dev)
+		return -1;
 
-		if (pfd[p].revents & (POLLNVAL | POLLERR)) {
-			fprintf(stderr, "UGCI(%d): Error polling, disabling\n", i);
-			disable_dev(i);
-			continue;
-		}
+	ugci_fill_uref(type, &uref_multi);
 
-		if (pfd[p].revents & POLLIN) {
-			rd = read(dev->fd, ev, sizeof(ev));
+	ret = dev->be->get_usages(dev, &uref_multi);
+	ugci_unlock_dev(dev);
 
-			if (rd < (int) sizeof(ev[0])) {
-				fprintf(stderr, "UGCI(%d): Error reading, disabling\n", i);
-				perror("read");
-				disable_dev(i);
-				continue;
-			}
+	if (ret)
+		return -1;
 
-			for (t = 0; t < (rd / sizeof(ev[0])); t++) {
-				enum ugci_event_type type = 0;
-				int value;
-				int id = ev[t].report_id == UGCI_PLAYER_1_REPORT ? 0 : 1;
-				int player = id + (i * 2);
-
-				switch (ev[t].usage_code) {
-					case UGCI_PLAYER_UCODE_PLAY:
-						if (! (ugci_event_mask & UGCI_EVENT_MASK_PLAY))
-							continue;
-
-						type = UGCI_EVENT_PLAY;
-						value = ev[t].value;
-						break;
-					case UGCI_PLAYER_UCODE_COIN:
-						if (! (ugci_event_mask & UGCI_EVENT_MASK_COIN))
-							continue;
-
-						type = UGCI_EVENT_COIN;
-						if (sim_coin_wait) {
-							/* See if we need to force a premature release */
-							if (dev->coin_pressed[id]) {
-								events++;
-								ugci_send_event(player, type, 0);
-							} else
-								dev->coin_pressed[id] = 1;
-
-							gettimeofday(&dev->last_tv[id], NULL);
-							value = 1;
-						} else {
-							value = ev[t].value;
-						}
-						break;
-						
-					default:
-						continue;
-				}
+	/* XXX Not endian safe */
+	*count = uref_multi.values[0];
 
-				events++;
-				ugci_send_event(player, type, value);
-			}
-		}
+	return 0;
+}
 
-		/* Now check for psuedo coin-release events */
-		if (sim_coin_wait) {
-			for (t = 0; t < 2; t++) {
-				int player = t + (i * 2);
-				struct timeval tv;
+/* Coin and play are separate fields in each player's report, and one
+ * HIDIOCGUSAGES only covers one field, so this is four of them. They come
+ * from the kernel's copy of the last report, so none of them go out on
+ * the wire, and they are all done under the one lock so they match.
+ * Called with the device locked. */
+static int __ugci_get_snapshot(struct ugci_dev_info *dev, struct ugci_board_state *state)
+{
+	static const enum ugci_report_type types[4] = {
+		UGCI_UREF_P1_COIN, UGCI_UREF_P1_PLAY,
+		UGCI_UREF_P2_COIN, UGCI_UREF_P2_PLAY,
+	};
+	struct hiddev_usage_ref_multi uref_multi;
+	int i;
 
-				if (! dev->coin_pressed[t])
-					continue;
+	for (i = 0; i < 4; i++) {
+		ugci_fill_uref(types[i], &uref_multi);
 
-				gettimeofday(&tv, NULL);
+		if (dev->be->get_usages(dev, &uref_multi))
+			return -1;
 
-				if (ugci_tv_to_msec(&dev->last_tv[t]) + sim_coin_wait <
-				    ugci_tv_to_msec(&tv)) {
-					events++;
-					ugci_send_event(player, UGCI_EVENT_COIN, 0);
-					dev->coin_pressed[t] = 0;
-				}
+		if (i & 1)
+			state->play[i / 2] = uref_multi.values[0];
+		else
+			state->coins[i / 2] = uref_multi.values[0];
+	}
+
+	return 0;
+}
+
+int ugci_ctx_get_snapshot(struct ugci_ctx *ctx, int id, struct ugci_board_state *state)
+{
+	struct ugci_dev_info *dev = ugci_lock_dev(ctx, id);
+	int ret;
+
+	if (!dev)
+		return -1;
+
+	ret = __ugci_get_snapshot(dev, state);
+	ugci_unlock_dev(dev);
+
+	return ret;
+}
+
+/* The security buffer (AKA serial buffer) is a 14 byte non-volatile area.
+ * It must be read in 2 7-byte reads. Not in the middle of the writer
+ * thread writing it, though. */
+static int __ugci_get_secblk(struct ugci_dev_info *dev, unsigned char values[UGCI_SEC_VALUES])
+{
+	struct hiddev_usage_ref_multi uref_multi;
+	int i, ret = -1;
+
+	pthread_mutex_lock(&dev->write_lock);
+
+	ugci_fill_uref(UGCI_UREF_SERIAL_READ_1, &uref_multi);
+
+	if (dev->be->get_usages(dev, &uref_multi) < 0)
+		goto out;
+
+	for (i = 0; i < uref_multi.num_values; i++)
+		values[i] = ((unsigned int)uref_multi.values[i]) & 0xff;
+
+	ugci_fill_uref(UGCI_UREF_SERIAL_READ_2, &uref_multi);
+
+	if (dev->be->get_usages(dev, &uref_multi) < 0)
+		goto out;
+
+	for (i = 0; i < 7; i++)
+		values[i + 7] = ((unsigned int)uref_multi.values[i]) & 0xff;
+
+	ret = 0;
+out:
+	pthread_mutex_unlock(&dev->write_lock);
+
+	return ret;
+}
+
+int ugci_ctx_get_secblk(struct ugci_ctx *ctx, int id, unsigned char values[UGCI_SEC_VALUES])
+{
+	struct ugci_dev_info *dev = ugci_lock_dev(ctx, id);
+	int ret;
+
+	if (!dev)
+		return -1;
+
+	ret = __ugci_get_secblk(dev, values);
+	ugci_unlock_dev(dev);
+
+	return ret;
+}
+
+/* Send the output reports for one command, for the writer thread or
+ * right away. Called with write_lock held. */
+int ugci_cmd_send(struct ugci_dev_info *dev, enum ugci_command cmd, const unsigned int *values)
+{
+	struct hiddev_usage_ref_multi uref_multi;
+	int i;
+
+	switch (cmd) {
+		case UGCI_CMD_WD_BOOT:
+		case UGCI_CMD_WD_RUNTIME:
+			ugci_fill_uref(UGCI_UREF_WD_ACTION, &uref_multi);
+			uref_multi.values[0] = cmd == UGCI_CMD_WD_BOOT ?
+				UGCI_WD_BOOT : UGCI_WD_RUNTIME;
+			if (dev->be->set_usages(dev, &uref_multi) < 0)
+				return -1;
+
+			ugci_fill_uref(UGCI_UREF_WD_TIMEOUT, &uref_multi);
+			uref_multi.values[0] = values[0];
+			if (dev->be->set_usages(dev, &uref_multi) < 0)
+				return -1;
+
+			/* Both of these are on the same report_id, and must be
+			 * committed together. */
+			return ugci_commit_uref(dev, UGCI_UREF_WD_ACTION);
+
+		case UGCI_CMD_KBD_MODE:
+			ugci_fill_uref(UGCI_UREF_KBD_MODE, &uref_multi);
+			uref_multi.values[0] = values[0];
+			uref_multi.values[1] = values[1];
+			if (dev->be->set_usages(dev, &uref_multi) < 0)
+				return -1;
+
+			return ugci_commit_uref(dev, UGCI_UREF_KBD_MODE);
+
+		case UGCI_CMD_SECBLK:
+			/* Handle first 7 bytes */
+			ugci_fill_uref(UGCI_UREF_SERIAL_WRITE_1, &uref_multi);
+
+			for (i = 0; i < uref_multi.num_values; i++)
+				uref_multi.values[i] = values[i];
+
+			if (dev->be->set_usages(dev, &uref_multi) < 0)
+				return -1;
+
+			if (ugci_commit_uref(dev, UGCI_UREF_SERIAL_WRITE_1))
+				return -1;
+
+			/* Now the second half */
+			ugci_fill_uref(UGCI_UREF_SERIAL_WRITE_2, &uref_multi);
+
+			for (i = 0; i < uref_multi.num_values; i++)
+				uref_multi.values[i] = values[i + 7];
+
+			if (dev->be->set_usages(dev, &uref_multi) < 0)
+				return -1;
+
+			return ugci_commit_uref(dev, UGCI_UREF_SERIAL_WRITE_2);
+
+		default:
+			return -1;
+	}
+}
+
+static int __ugci_set_secblk(struct ugci_dev_info *dev, unsigned char values[UGCI_SEC_VALUES])
+{
+	unsigned int v[UGCI_SEC_VALUES];
+	int i, ret;
+
+	for (i = 0; i < UGCI_SEC_VALUES; i++)
+		v[i] = values[i];
+
+	pthread_mutex_lock(&dev->write_lock);
+	ret = ugci_cmd_send(dev, UGCI_CMD_SECBLK, v);
+	pthread_mutex_unlock(&dev->write_lock);
+
+	if (ret)
+		return -1;
+
+	/* Reread so caller can easily verify */
+	return __ugci_get_secblk(dev, values);
+}
+
+int ugci_ctx_set_secblk(struct ugci_ctx *ctx, int id, unsigned char values[UGCI_SEC_VALUES])
+{
+	struct ugci_dev_info *dev = ugci_lock_dev(ctx, id);
+	int ret;
+
+	if (!dev)
+		return -1;
+
+	ret = __ugci_set_secblk(dev, values);
+	ugci_unlock_dev(dev);
+
+	return ret;
+}
+
+int ugci_ctx_queue_secblk(struct ugci_ctx *ctx, int id, unsigned char values[UGCI_SEC_VALUES])
+{
+	struct ugci_dev_info *dev = ugci_lock_dev(ctx, id);
+	unsigned int v[UGCI_SEC_VALUES];
+	int i, ret;
+
+	if (!dev)
+		return -1;
+
+	for (i = 0; i < UGCI_SEC_VALUES; i++)
+		v[i] = values[i];
+
+	ret = ugci_writer_queue(dev, UGCI_CMD_SECBLK, v, UGCI_SEC_VALUES);
+	ugci_unlock_dev(dev);
+
+	return ret;
+}
+
+/* Sent right away, or queued for the writer thread */
+static int __ugci_set_watchdog(struct ugci_dev_info *dev, int type,
+			       unsigned short seconds, int quiet, int queue)
+{
+	enum ugci_command cmd = type == UGCI_WD_BOOT ? UGCI_CMD_WD_BOOT :
+		UGCI_CMD_WD_RUNTIME;
+	unsigned long long prev;
+	unsigned int value = seconds;
+	int ret;
+
+	if (type != UGCI_WD_BOOT && type != UGCI_WD_RUNTIME)
+		return -1;
+
+	if (dev->ctx->info_out && !quiet) {
+		if (seconds)
+			printf("UGCI(%d): Setting watchdog %s timer for %u second interval\n",
+			       dev->id, type == UGCI_WD_BOOT ? "boot" : "runtime", seconds);
+		else
+			printf("UGCI(%d): Disabling watchdog %s timer\n", dev->id,
+			       type == UGCI_WD_BOOT ? "boot" : "runtime");
+	}
+
+	if (queue) {
+		ret = ugci_writer_queue(dev, cmd, &value, 1);
+		pthread_mutex_lock(&dev->write_lock);
+	} else {
+		pthread_mutex_lock(&dev->write_lock);
+		prev = dev->last_wd;
+		ret = ugci_cmd_send(dev, cmd, &value);
+		if (!ret && cmd == UGCI_CMD_WD_RUNTIME) {
+			UGCI_STAT_ADD(dev->stats.wd_refreshes, 1);
+			/* Only a refresh of what was already set has a deadline */
+			if (quiet)
+				ugci_wd_deadline(dev, prev, seconds, ugci_now());
+		}
+	}
+
+	/* Set our interval. This is under write_lock so that the watchdog
+	 * thread cannot send the old one after it. */
+	if (!ret && type == UGCI_WD_RUNTIME) {
+		__atomic_store_n(&dev->wd_interval, seconds, __ATOMIC_RELAXED);
+		__atomic_store_n(&dev->last_wd, ugci_now(), __ATOMIC_RELAXED);
+	}
+
+	pthread_mutex_unlock(&dev->write_lock);
+
+	if (ret)
+		return -1;
+
+	if (type == UGCI_WD_RUNTIME)
+		ugci_dev_arm(dev);
+
+	return 0;
+}
+
+int ugci_ctx_set_watchdog(struct ugci_ctx *ctx, int id, int type, unsigned short seconds)
+{
+	struct ugci_dev_info *dev = ugci_lock_dev(ctx, id);
+	int ret;
+
+	if (!dev)
+		return -1;
+
+	ret = __ugci_set_watchdog(dev, type, seconds, 0, 0);
+	ugci_unlock_dev(dev);
+
+	return ret;
+}
+
+int ugci_ctx_queue_watchdog(struct ugci_ctx *ctx, int id, int type, unsigned short seconds)
+{
+	struct ugci_dev_info *dev = ugci_lock_dev(ctx, id);
+	int ret;
+
+	if (!dev)
+		return -1;
+
+	ret = __ugci_set_watchdog(dev, type, seconds, 0, 1);
+	ugci_unlock_dev(dev);
+
+	return ret;
+}
+
+/* The watchdog thread naps no longer than this, to notice new watchdogs
+ * and being stopped */
+#define UGCI_WD_NAP	100000000ULL
+
+/* Send a runtime refresh if one is still due. Called from the watchdog
+ * thread, without the device lock. */
+static int ugci_wd_refresh(struct ugci_dev_info *dev)
+{
+	unsigned long long now, due, prev;
+	unsigned int value;
+	int ret = 0;
+
+	pthread_mutex_lock(&dev->write_lock);
+
+	value = dev->wd_interval;
+	now = ugci_now();
+
+	if (dev->fd >= 0 && value && (due = ugci_wd_due(dev)) <= now) {
+		prev = dev->last_wd;
+
+		if (!(ret = ugci_cmd_send(dev, UGCI_CMD_WD_RUNTIME, &value))) {
+			ugci_stat_hist(dev->stats.wd_jitter, now - due);
+			UGCI_STAT_ADD(dev->stats.wd_refreshes, 1);
+
+			now = ugci_now();
+			ugci_wd_deadline(dev, prev, value, now);
+			__atomic_store_n(&dev->last_wd, now, __ATOMIC_RELAXED);
+		}
+	}
+
+	pthread_mutex_unlock(&dev->write_lock);
+
+	return ret;
+}
+
+static void *ugci_wd_main(void *arg)
+{
+	struct ugci_ctx *ctx = arg;
+	struct ugci_dev_info *dev;
+	unsigned long long now, due, next;
+	struct timespec ts;
+	int i;
+
+	while (! __atomic_load_n(&ctx->wd_stop, __ATOMIC_RELAXED)) {
+		now = ugci_now();
+		next = now + UGCI_WD_NAP;
+
+		for (i = 0; (dev = ugci_get_slot(ctx, i)); i++) {
+			if (! __atomic_load_n(&dev->wd_interval, __ATOMIC_RELAXED))
+				continue;
+
+			/* A failed one waits out the nap */
+			if ((due = ugci_wd_due(dev)) <= now &&
+			    ugci_wd_refresh(dev) == 0)
+				due = ugci_wd_due(dev);
+
+			if (due > now && due < next)
+				next = due;
+		}
+
+		ts.tv_sec = next / 1000000000ULL;
+		ts.tv_nsec = next % 1000000000ULL;
+
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+			;
+	}
+
+	return NULL;
+}
+
+int ugci_ctx_start_watchdog(struct ugci_ctx *ctx, int priority)
+{
+	struct sched_param sp = { .sched_priority = priority };
+	pthread_attr_t attr;
+	int ret = 0, err;
+
+	pthread_mutex_lock(&ctx->poll_lock);
+
+	if (! ctx->initialized || ctx->wd_running) {
+		pthread_mutex_unlock(&ctx->poll_lock);
+		return -1;
+	}
+
+	ctx->wd_stop = 0;
+
+	pthread_attr_init(&attr);
+	if (priority > 0) {
+		pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+		pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+		pthread_attr_setschedparam(&attr, &sp);
+	}
+
+	err = pthread_create(&ctx->wd_thread, &attr, ugci_wd_main, ctx);
+	if (err == EPERM && priority > 0) {
+		if (ctx->info_out)
+			printf("UGCI: Not allowed real-time priority for the watchdog thread\n");
+		err = pthread_create(&ctx->wd_thread, NULL, ugci_wd_main, ctx);
+	}
+
+	pthread_attr_destroy(&attr);
+
+	if (err)
+		ret = -1;
+	else
+		__atomic_store_n(&ctx->wd_running, 1, __ATOMIC_RELAXED);
+
+	pthread_mutex_unlock(&ctx->poll_lock);
+
+	return ret;
+}
+
+void ugci_ctx_stop_watchdog(struct ugci_ctx *ctx)
+{
+	struct ugci_dev_info *dev;
+	int i;
+
+	pthread_mutex_lock(&ctx->poll_lock);
+
+	if (ctx->wd_running) {
+		__atomic_store_n(&ctx->wd_stop, 1, __ATOMIC_RELAXED);
+		pthread_join(ctx->wd_thread, NULL);
+		__atomic_store_n(&ctx->wd_running, 0, __ATOMIC_RELAXED);
+
+		/* Refreshes go back to the device timers */
+		for (i = 0; (dev = ugci_get_slot(ctx, i)); i++) {
+			pthread_mutex_lock(&dev->lock);
+			if (dev->fd >= 0)
+				ugci_dev_arm(dev);
+			pthread_mutex_unlock(&dev->lock);
+		}
+	}
+
+	pthread_mutex_unlock(&ctx->poll_lock);
+}
+
+
+static void ugci_show_eeprom(struct ugci_dev_info *dev, int cached)
+{
+	printf("UGCI(%d): Key mapping %sabled%s\n", dev->id,
+		dev->eeprom[0] & 0x01 ? "en" : "dis", cached ? " (cached)" : "");
+
+	printf("UGCI(%d): %d byte EEPROM\n", dev->id,
+		dev->eeprom[0] & 0x02 ? 512 : 128);
+
+	if (dev->eeprom[0] & 0x04)
+		printf("UGCI(%d): Surface mount board (rev C)\n", dev->id);
+	else
+		printf("UGCI(%d): Thru hole board (rev C)\n", dev->id);
+}
+
+/* The eeprom is a single 504 value transfer, which is slow enough that
+ * we only do it when someone wants it. With the probe cache, a board we
+ * have seen on this port before only needs its security block read to
+ * prove it is the same one. Called with the device locked. */
+static int ugci_load_eeprom(struct ugci_dev_info *dev)
+{
+	struct hiddev_usage_ref_multi uref_multi;
+	unsigned char serial[UGCI_SEC_VALUES];
+	int t, have_serial = 0;
+
+	if (dev->eeprom_state == UGCI_EEPROM_READY)
+		return 0;
+
+	if (dev->ctx->cache_path)
+		have_serial = (__ugci_get_secblk(dev, serial) == 0);
+
+	if (have_serial && ugci_cache_lookup(dev, serial) == 0) {
+		if (dev->ctx->info_out)
+			ugci_show_eeprom(dev, 1);
+		__atomic_store_n(&dev->eeprom_state, UGCI_EEPROM_READY, __ATOMIC_RELEASE);
+		return 0;
+	}
+
+	ugci_fill_uref(UGCI_UREF_EEPROM_READ, &uref_multi);
+	if (dev->be->get_usages(dev, &uref_multi) < 0) {
+		fprintf(stderr, "UGCI(%d): Error reading eeprom\n", dev->id);
+		__atomic_store_n(&dev->eeprom_state, UGCI_EEPROM_FAILED, __ATOMIC_RELEASE);
+		return -1;
+	}
+
+	for (t = 0; t < uref_multi.num_values; t++)
+		dev->eeprom[t] = (unsigned char)uref_multi.values[t];
+
+	if (dev->ctx->info_out)
+		ugci_show_eeprom(dev, 0);
+
+	dev->eeprom_len = (dev->eeprom[0] & 0x02) ? 504 : 120;
+	__atomic_store_n(&dev->eeprom_state, UGCI_EEPROM_READY, __ATOMIC_RELEASE);
+
+	if (have_serial)
+		ugci_cache_store(dev, serial);
+
+	return 0;
+}
+
+int ugci_ctx_get_eeprom(struct ugci_ctx *ctx, int id, unsigned char *data, int *len)
+{
+	struct ugci_dev_info *dev = ugci_lock_dev(ctx, id);
+	int ret = -1;
+
+	if (!dev)
+		return -1;
+
+	if (data != NULL && ugci_load_eeprom(dev) == 0) {
+		memcpy(data, dev->eeprom, dev->eeprom_len);
+		*len = dev->eeprom_len;
+		ret = 0;
+	}
+
+	ugci_unlock_dev(dev);
+
+	return ret;
+}
+
+/* Does not take the device lock, which the loader holds for the whole
+ * transfer */
+int ugci_ctx_eeprom_status(struct ugci_ctx *ctx, int id)
+{
+	struct ugci_dev_info *dev = ugci_get_slot(ctx, id);
+
+	if (!dev || __atomic_load_n(&dev->fd, __ATOMIC_RELAXED) < 0)
+		return -1;
+
+	return __atomic_load_n(&dev->eeprom_state, __ATOMIC_ACQUIRE);
+}
+
+static void *ugci_eeprom_main(void *arg)
+{
+	struct ugci_ctx *ctx = arg;
+	struct ugci_dev_info *dev;
+	int i;
+
+	for (i = 0; ! __atomic_load_n(&ctx->eeprom_stop, __ATOMIC_ACQUIRE); i++) {
+		if (!(dev = ugci_get_slot(ctx, i)))
+			break;
+
+		pthread_mutex_lock(&dev->lock);
+		if (dev->fd >= 0 && dev->eeprom_state == UGCI_EEPROM_UNREAD)
+			ugci_load_eeprom(dev);
+		pthread_mutex_unlock(&dev->lock);
+	}
+
+	if (ctx->cache_path)
+		ugci_cache_save(ctx);
+
+	__atomic_store_n(&ctx->eeprom_busy, 0, __ATOMIC_RELEASE);
+
+	return NULL;
+}
+
+/* Reap the loader thread. Only waits for it if told to, otherwise it has
+ * to be done already. Called with devs_lock held, unless waiting. */
+static int ugci_eeprom_join(struct ugci_ctx *ctx, int wait)
+{
+	if (! ctx->eeprom_started)
+		return 0;
+
+	if (wait)
+		__atomic_store_n(&ctx->eeprom_stop, 1, __ATOMIC_RELEASE);
+	else if (__atomic_load_n(&ctx->eeprom_busy, __ATOMIC_ACQUIRE))
+		return -1;
+
+	pthread_join(ctx->eeprom_thread, NULL);
+	ctx->eeprom_started = 0;
+
+	return 0;
+}
+
+int ugci_ctx_load_eeproms(struct ugci_ctx *ctx)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&ctx->devs_lock);
+
+	/* Still going from last time, which will pick up anything new */
+	if (! ctx->initialized || ugci_eeprom_join(ctx, 0) < 0)
+		goto out;
+
+	ctx->eeprom_stop = 0;
+	ctx->eeprom_busy = 1;
+	if (pthread_create(&ctx->eeprom_thread, NULL, ugci_eeprom_main, ctx))
+		ret = -1;
+	else
+		ctx->eeprom_started = 1;
+
+out:
+	pthread_mutex_unlock(&ctx->devs_lock);
+
+	return ret;
+}
+
+/* Sent right away, or queued for the writer thread */
+static int __ugci_kbd_mode(struct ugci_ctx *ctx, int id, int mode,
+			   unsigned char delay, int queue)
+{
+	unsigned int values[2] = { mode, delay };
+	struct ugci_dev_info *dev;
+	int ret;
+
+	if (mode < UGCI_KBD_NONE || mode > UGCI_KBD_BOOT)
+		return -1;
+
+	if (!(dev = ugci_lock_dev(ctx, id)))
+		return -1;
+
+	if (ctx->info_out) {
+		printf("UGCI(%d): Setting keyboard mode to %s (%u delay)\n", id,
+		       mode == UGCI_KBD_NONE ? "NONE" : mode == UGCI_KBD_HID ? "HID" : "BOOT",
+		       delay);
+	}
+
+	if (queue) {
+		ret = ugci_writer_queue(dev, UGCI_CMD_KBD_MODE, values, 2);
+	} else {
+		pthread_mutex_lock(&dev->write_lock);
+		ret = ugci_cmd_send(dev, UGCI_CMD_KBD_MODE, values);
+		pthread_mutex_unlock(&dev->write_lock);
+	}
+
+	ugci_unlock_dev(dev);
+
+	return ret ? -1 : 0;
+}
+
+int ugci_ctx_kbd_mode(struct ugci_ctx *ctx, int id, int mode, unsigned char delay)
+{
+	return __ugci_kbd_mode(ctx, id, mode, delay, 0);
+}
+
+int ugci_ctx_queue_kbd_mode(struct ugci_ctx *ctx, int id, int mode, unsigned char delay)
+{
+	return __ugci_kbd_mode(ctx, id, mode, delay, 1);
+}
+
+unsigned int ugci_get_version(void)
+{
+	return LIBUGCI_VERSION;
+}
+
+
+/* Taking the poll lock means it never changes in the middle of a
+ * dispatch, so the data always goes with its own callback */
+void ugci_ctx_set_event_callback(struct ugci_ctx *ctx, ugci_event_callback_t cb, void *data)
+{
+	pthread_mutex_lock(&ctx->poll_lock);
+	ctx->event_cb = cb;
+	ctx->event_cb_data = data;
+	pthread_mutex_unlock(&ctx->poll_lock);
+}
+
+void ugci_ctx_set_coin_simulate(struct ugci_ctx *ctx, int wait_time)
+{
+	struct ugci_dev_info *dev;
+	int i;
+
+	ctx->sim_coin_wait = wait_time;
+
+	for (i = 0; (dev = ugci_get_slot(ctx, i)); i++) {
+		pthread_mutex_lock(&dev->lock);
+		if (dev->fd >= 0)
+			ugci_dev_arm(dev);
+		pthread_mutex_unlock(&dev->lock);
+	}
+}
+
+
+static void ugci_send_event(struct ugci_ctx *ctx, const struct ugci_event *event)
+{
+	DPRINT("UGCI(%d): Sending Player %d %s button: %d\n",
+	       event->id / 2, event->id + 1, ugci_event_to_name[event->type],
+	       event->value);
+
+	if (ctx->event_cb)
+		ctx->event_cb(event, ctx->event_cb_data);
+	else if (ctx->cb)
+		ctx->cb(event->id, event->type, event->value);
+}
+
+/* Only ever called from the reader thread */
+static void ugci_ring_push(struct ugci_ctx *ctx, struct ugci_ring *ring, int id,
+			   enum ugci_event_type type, int value,
+			   unsigned long long time)
+{
+	struct ugci_event *event;
+	unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	unsigned int tail = ring->tail;
+
+	if (tail - head == ring->size) {
+		__atomic_store_n(&ring->overflows, ring->overflows + 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	event = &ring->ev[tail & (ring->size - 1)];
+	event->time = time;
+	event->id = id;
+	event->type = type;
+	event->value = value;
+
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&ring->pushed, ring->pushed + 1, __ATOMIC_RELAXED);
+
+	if (tail + 1 - head > ring->high_water)
+		__atomic_store_n(&ring->high_water, tail + 1 - head, __ATOMIC_RELAXED);
+
+	/* Let the consumer know about it, unless it already does */
+	if (! __atomic_exchange_n(&ring->queued, 1, __ATOMIC_SEQ_CST)) {
+		struct ugci_ring *next = __atomic_load_n(&ctx->ready, __ATOMIC_RELAXED);
+
+		do {
+			ring->next = next;
+		} while (! __atomic_compare_exchange_n(&ctx->ready, &next, ring, 1,
+						       __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	}
+
+	if (time > ctx->reader_time)
+		__atomic_store_n(&ctx->reader_time, time, __ATOMIC_RELEASE);
+}
+
+/* Events up to and including time until. Only ever called from the
+ * consumer. */
+static int ugci_ring_pop(struct ugci_ring *ring, struct ugci_event *out, int max,
+			 unsigned long long until)
+{
+	unsigned int head = ring->head;
+	unsigned int tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	int n;
+
+	for (n = 0; n < max && head != tail; n++, head++) {
+		if (ring->ev[head & (ring->size - 1)].time > until)
+			break;
+		out[n] = ring->ev[head & (ring->size - 1)];
+	}
+
+	__atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+
+	return n;
+}
+
+static void ugci_queue_event(struct ugci_dev_info *dev, int id,
+			     enum ugci_event_type type, int value,
+			     unsigned long long time)
+{
+	struct ugci_ctx *ctx = dev->ctx;
+	struct ugci_event *event;
+
+	if (dev->ring) {
+		ugci_ring_push(ctx, dev->ring, id, type, value, time);
+		return;
+	}
+
+	/* Can't happen as long as we only gather into an empty queue */
+	if (ctx->evq_tail - ctx->evq_head == ctx->evq_size) {
+		fprintf(stderr, "UGCI: Event queue overflow, dropping event\n");
+		return;
+	}
+
+	event = &ctx->evq[ctx->evq_tail++ & (ctx->evq_size - 1)];
+	event->time = time;
+	event->id = id;
+	event->type = type;
+	event->value = value;
+}
+
+/* Turn one read's worth of usage refs into events, and keep the state
+ * table up to date. The state is the device's first player in the table.
+ * Called with the device locked. */
+static int ugci_dev_decode(struct ugci_dev_info *dev, struct ugci_player_state *state,
+			   const struct hiddev_usage_ref *ev, int count,
+			   unsigned long long now, int *rearm)
+{
+	struct ugci_ctx *ctx = dev->ctx;
+	int t, events = 0, filtered = 0;
+
+	for (t = 0; t < count; t++) {
+		enum ugci_event_type type = 0;
+		int value, bit;
+		int id = (ev[t].report_id == UGCI_PLAYER_1_REPORT ||
+			  ev[t].report_id == UGCI_JOYSTICK_1_REPORT) ? 0 : 1;
+		int player = id + (dev->id * 2);
+
+		switch (ev[t].usage_code) {
+			case UGCI_PLAYER_UCODE_PLAY:
+				UGCI_STATE_SET(&state[id], play, ev[t].value);
+
+				if (! (ctx->event_mask & UGCI_EVENT_MASK_PLAY)) {
+					filtered++;
+					continue;
+				}
+
+				type = UGCI_EVENT_PLAY;
+				value = ev[t].value;
+				break;
+			case UGCI_PLAYER_UCODE_COIN:
+				UGCI_STATE_SET(&state[id], coins, ev[t].value);
+
+				if (! (ctx->event_mask & UGCI_EVENT_MASK_COIN)) {
+					filtered++;
+					continue;
+				}
+
+				type = UGCI_EVENT_COIN;
+				if (ctx->sim_coin_wait) {
+					/* See if we need to force a premature release */
+					if (dev->coin_pressed[id]) {
+						events++;
+						UGCI_STAT_ADD(dev->stats.forced_releases, 1);
+						ugci_queue_event(dev, player, type, 0, now);
+					} else
+						dev->coin_pressed[id] = 1;
+
+					dev->coin_time[id] = now;
+					*rearm = 1;
+					value = 1;
+				} else {
+					value = ev[t].value;
+				}
+				break;
+
+			case UGCI_JOYSTICK_UCODE_X:
+				UGCI_STATE_SET(&state[id], axis_x, ev[t].value);
+
+				if (! (ctx->event_mask & UGCI_EVENT_MASK_AXIS)) {
+					filtered++;
+					continue;
+				}
+
+				type = UGCI_EVENT_AXIS_X;
+				value = ev[t].value;
+				break;
+			case UGCI_JOYSTICK_UCODE_Y:
+				UGCI_STATE_SET(&state[id], axis_y, ev[t].value);
+
+				if (! (ctx->event_mask & UGCI_EVENT_MASK_AXIS)) {
+					filtered++;
+					continue;
+				}
+
+				type = UGCI_EVENT_AXIS_Y;
+				value = ev[t].value;
+				break;
+			case UGCI_JOYSTICK_UCODE_BUT_1 ... UGCI_JOYSTICK_UCODE_BUT_7:
+				bit = 1 << (ev[t].usage_code - UGCI_JOYSTICK_UCODE_BUT_1);
+				UGCI_STATE_SET(&state[id], buttons, ev[t].value ?
+					       state[id].buttons | bit :
+					       state[id].buttons & ~bit);
+
+				if (! (ctx->event_mask & UGCI_EVENT_MASK_BUTTON)) {
+					filtered++;
+					continue;
+				}
+
+				type = UGCI_EVENT_BUTTON_1 +
+					(ev[t].usage_code - UGCI_JOYSTICK_UCODE_BUT_1);
+				value = ev[t].value;
+				break;
+
+			default:
+				continue;
+		}
+
+		events++;
+		ugci_queue_event(dev, player, type, value, now);
+	}
+
+	UGCI_STAT_ADD(dev->stats.events, events);
+	UGCI_STAT_ADD(dev->stats.filtered, filtered);
+
+	return events;
+}
+
+/* Read and dispatch whatever is pending on one device, and return how
+ * many events that was. The revents are in poll(2) terms, which the epoll
+ * flags we care about are identical to. The fd is non-blocking, so we
+ * keep reading until it says EAGAIN or a read comes back short, for up to
+ * budget reads, and a burst does not have to wait for the next poll. more
+ * is set if the budget ran out, so there may still be more waiting.
+ * Called with the device locked. */
+static int ugci_dev_events(struct ugci_dev_info *dev, int revents, int budget,
+			   int *more)
+{
+	struct ugci_ctx *ctx = dev->ctx;
+	struct hiddev_usage_ref *ev = ctx->read_buf;
+	size_t size = ctx->read_urefs * sizeof(*ev);
+	struct ugci_player_state *state;
+	unsigned long long now;
+	int reads, rd, events = 0, rearm = 0, failed = 0;
+
+	*more = 0;
+
+	if (revents & (POLLNVAL | POLLERR)) {
+		fprintf(stderr, "UGCI(%d): Error polling, disabling\n", dev->id);
+		disable_dev(dev);
+		return 0;
+	}
+
+	if (!(revents & POLLIN))
+		return 0;
+
+	for (reads = 0; reads < budget; reads++) {
+		rd = dev->be->read(dev, ev, size);
+		now = ugci_now();
+
+		if (rd < 0 && errno == EINTR)
+			continue;
+		if (rd < 0 && errno == EAGAIN)
+			break;
+
+		if (rd < (int) sizeof(ev[0])) {
+			failed = 1;
+			break;
+		}
+
+		UGCI_STAT_ADD(dev->stats.reads, 1);
+		UGCI_STAT_ADD(dev->stats.bytes, rd);
+		if (rd == size)
+			UGCI_STAT_ADD(dev->stats.full_reads, 1);
+
+		/* The state table sees everything, whatever the mask. Only
+		 * the decode is in the write section, so a reader of it
+		 * never waits on a read. */
+		state = ugci_state_begin(ctx) + dev->id * 2;
+		events += ugci_dev_decode(dev, state, ev, rd / sizeof(ev[0]), now, &rearm);
+		ugci_state_end(ctx);
+
+		/* Outside the write section, the recording can block in
+		 * stdio. The decode leaves ev alone. */
+		if (__atomic_load_n(&ctx->record, __ATOMIC_RELAXED))
+			ugci_record_batch(dev, ev, rd / sizeof(ev[0]), now);
+
+		/* Short means there was no more, which saves the read that
+		 * would only have said EAGAIN */
+		if (rd < size)
+			break;
+	}
+
+	*more = reads == budget;
+
+	if (failed) {
+		fprintf(stderr, "UGCI(%d): Error reading, disabling\n", dev->id);
+		if (rd < 0)
+			perror("read");
+		disable_dev(dev);
+		return events;
+	}
+
+	if (rearm)
+		ugci_dev_arm(dev);
+
+	return events;
+}
+
+/* Psuedo coin-release events and the watchdog refresh. Only called when
+ * the device's timer fires, or from the poll(2) fallback. Called with the
+ * device locked. */
+static int ugci_dev_timers(struct ugci_dev_info *dev)
+{
+	unsigned long long now = ugci_now(), due;
+	int t, events = 0, wait = dev->ctx->sim_coin_wait;
+	uint64_t exp;
+
+	if (read(dev->timer_fd, &exp, sizeof(exp)) < 0 && errno != EAGAIN)
+		DPRINT("UGCI(%d): Timer read failed\n", dev->id);
+
+	if (wait) {
+		for (t = 0; t < 2; t++) {
+			int player = t + (dev->id * 2);
+
+			if (! dev->coin_pressed[t])
+				continue;
+
+			due = dev->coin_time[t] + wait * 1000000ULL;
+
+			if (due <= now) {
+				events++;
+				ugci_queue_event(dev, player, UGCI_EVENT_COIN, 0, due);
+				dev->coin_pressed[t] = 0;
+			}
+		}
+	}
+
+	/* Left to the writer thread if it is running, so the control
+	 * transfer does not hold up input. Nothing to do here at all if the
+	 * watchdog thread is. */
+	if (dev->wd_interval && ! __atomic_load_n(&dev->ctx->wd_running, __ATOMIC_RELAXED) &&
+	    (due = ugci_wd_due(dev)) <= now &&
+	    __ugci_set_watchdog(dev, UGCI_WD_RUNTIME, dev->wd_interval, 1,
+				__atomic_load_n(&dev->ctx->writer_running,
+						__ATOMIC_RELAXED)) == 0)
+		ugci_stat_hist(dev->stats.wd_jitter, now - due);
+
+	UGCI_STAT_ADD(dev->stats.events, events);
+
+	ugci_dev_arm(dev);
+
+	return events;
+}
+
+/* Find the attached device for a hiddev node number */
+static struct ugci_dev_info *ugci_find_node(struct ugci_ctx *ctx, int index)
+{
+	struct ugci_dev_info *dev;
+	char node[16];
+	int i;
+
+	snprintf(node, sizeof(node), "%s%d", ctx->backend->node, index);
+
+	for (i = 0; (dev = ugci_get_slot(ctx, i)); i++) {
+		const char *base = strrchr(dev->path, '/');
+
+		if (dev->fd >= 0 && base && strcmp(base + 1, node) == 0)
+			return dev;
+	}
+
+	return NULL;
+}
+
+static int ugci_hotplug_events(struct ugci_ctx *ctx)
+{
+	struct ugci_dev_info *dev;
+	struct ugci_ring *ring;
+	int add, index, ret, events = 0;
+
+	while ((ret = ugci_hotplug_read(ctx->hotplug_fd, ctx->backend->node,
+					&add, &index)) >= 0) {
+		if (!ret)
+			continue;
+
+		dev = ugci_find_node(ctx, index);
+
+		if (!add) {
+			if (dev) {
+				pthread_mutex_lock(&dev->lock);
+				if (ctx->info_out)
+					printf("UGCI(%d): Removed %s\n", dev->id, dev->path);
+				disable_dev(dev);
+				pthread_mutex_unlock(&dev->lock);
+				events += !!(ctx->event_mask & UGCI_EVENT_MASK_DEVICE);
+			}
+			continue;
+		}
+
+		/* We may hear about it from both the kernel and udev */
+		if (dev)
+			continue;
+
+		/* The reader thread may be what is running us. Without a
+		 * ring it would be writing the shared queue unlocked, so
+		 * we don't take the board on at all without one. */
+		ring = NULL;
+		if (ctx->reader_running) {
+			ring = calloc(1, sizeof(*ring) +
+				      ctx->reader_ring_size * sizeof(struct ugci_event));
+			if (!ring) {
+				fprintf(stderr, "UGCI: No memory to add %s%d\n",
+					ctx->backend->node, index);
+				continue;
+			}
+			ring->size = ctx->reader_ring_size;
+		}
+
+		if (!(dev = ugci_attach(ctx, index))) {
+			free(ring);
+			continue;
+		}
+
+		pthread_mutex_lock(&dev->lock);
+
+		/* A reused slot still has the one it had */
+		if (ring && !dev->ring)
+			dev->ring = ring;
+		else
+			free(ring);
+
+		if (ugci_epoll_register(dev) < 0) {
+			fprintf(stderr, "UGCI(%d): Could not watch %s\n", dev->id, dev->path);
+			disable_dev(dev);
+			pthread_mutex_unlock(&dev->lock);
+			continue;
+		}
+
+		if (ctx->event_mask & UGCI_EVENT_MASK_DEVICE) {
+			ugci_queue_event(dev, dev->id * 2, UGCI_EVENT_DEVICE, 1, ugci_now());
+			events++;
+		}
+
+		pthread_mutex_unlock(&dev->lock);
+	}
+
+	return events;
+}
+
+int ugci_ctx_enable_hotplug(struct ugci_ctx *ctx)
+{
+	if (! ctx->initialized || ! ctx->backend->node || ctx->bus)
+		return -1;
+
+	if (ctx->hotplug_fd >= 0)
+		return 0;
+
+	/* We skip this when there was nothing found at init */
+	if (ctx->epfd < 0 && ugci_epoll_setup(ctx) < 0)
+		return -1;
+
+	if ((ctx->hotplug_fd = ugci_hotplug_open()) < 0)
+		return -1;
+
+	if (ugci_epoll_add(ctx, ctx->hotplug_fd, &ctx->hotplug_watch) < 0) {
+		close(ctx->hotplug_fd);
+		ctx->hotplug_fd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Everything is registered once with the epoll set, and each ready event
+ * carries what it belongs to, so there is nothing to set up per call and
+ * only the devices that are ready get looked at, however many there are.
+ * Anything past the batch is left for the next call.
+ *
+ * Each ready device gets one read, then the ones that had more get another
+ * each in turn, up to the read budget. A board with a backlog would
+ * otherwise have all of it read (and timestamped) ahead of a press on the
+ * next board. */
+static int ugci_wait_epoll(struct ugci_ctx *ctx, int timeout)
+{
+	struct epoll_event eev[UGCI_EPOLL_BATCH];
+	struct ugci_dev_info *more[UGCI_EPOLL_BATCH];
+	int i, m, n, round, again, nmore = 0, events = 0;
+
+	n = epoll_wait(ctx->epfd, eev, UGCI_EPOLL_BATCH, timeout);
+
+	for (i = 0; i < n; i++) {
+		struct ugci_watch *watch = eev[i].data.ptr;
+		struct ugci_dev_info *dev = watch->dev;
+		uint64_t exp;
+
+		switch (watch->type) {
+			case UGCI_WATCH_INPUT:
+			case UGCI_WATCH_TIMER:
+				pthread_mutex_lock(&dev->lock);
+
+				/* An earlier event may have disabled it */
+				if (dev->fd < 0)
+					;
+				else if (watch->type == UGCI_WATCH_INPUT) {
+					events += ugci_dev_events(dev, eev[i].events, 1, &again);
+					if (again)
+						more[nmore++] = dev;
+				} else
+					events += ugci_dev_timers(dev);
+
+				pthread_mutex_unlock(&dev->lock);
+				break;
+			case UGCI_WATCH_HOTPLUG:
+				events += ugci_hotplug_events(ctx);
+				break;
+			case UGCI_WATCH_WAKE:
+				/* Someone wants the reader thread's attention */
+				if (read(ctx->reader_wake_fd, &exp, sizeof(exp)) < 0)
+					DPRINT("UGCI: Reader wakeup read failed\n");
+				break;
+		}
+	}
+
+	for (round = 1; nmore && round < ctx->read_budget; round++) {
+		for (i = m = 0; i < nmore; i++) {
+			struct ugci_dev_info *dev = more[i];
+
+			pthread_mutex_lock(&dev->lock);
+			if (dev->fd >= 0) {
+				events += ugci_dev_events(dev, POLLIN, 1, &again);
+				if (again)
+					more[m++] = dev;
+			}
+			pthread_mutex_unlock(&dev->lock);
+		}
+
+		nmore = m;
+	}
+
+	return events;
+}
+
+/* Fallback for when we could not get an epoll instance. Each device has
+ * its input followed by its timer in the set. This one does scale with
+ * the number of devices, as poll(2) itself does. */
+static int ugci_wait_poll(struct ugci_ctx *ctx, int timeout)
+{
+	struct pollfd *pfd;
+	struct ugci_dev_info **pdev;
+	int i, fds, events, more;
+
+	if (ctx->poll_size < ctx->ndevs) {
+		pfd = realloc(ctx->pfd, ctx->devs_size * 2 * sizeof(*pfd));
+		if (pfd)
+			ctx->pfd = pfd;
+		pdev = realloc(ctx->pdev, ctx->devs_size * sizeof(*pdev));
+		if (pdev)
+			ctx->pdev = pdev;
+		if (!pfd || !pdev)
+			return 0;
+		ctx->poll_size = ctx->devs_size;
+	}
+
+	pfd = ctx->pfd;
+	pdev = ctx->pdev;
+
+	for (i = fds = 0; i < ctx->ndevs; i++) {
+		struct ugci_dev_info *dev = ctx->devs[i];
+
+		if (dev->fd < 0)
+			continue;
+
+		pdev[fds] = dev;
+
+		pfd[fds * 2].events = POLLIN;
+		pfd[fds * 2].fd = dev->fd;
+		pfd[fds * 2].revents = 0;
+
+		pfd[fds * 2 + 1].events = POLLIN;
+		pfd[fds * 2 + 1].fd = dev->timer_fd;
+		pfd[fds * 2 + 1].revents = 0;
+
+		fds++;
+	}
+
+	if (! fds)
+		return 0;
+
+	if (poll(pfd, fds * 2, timeout) <= 0)
+		return 0;
+
+	for (i = events = 0; i < fds; i++) {
+		/* Whatever doesn't fit is still there for next time */
+		if (ctx->evq_size - (ctx->evq_tail - ctx->evq_head) <
+		    UGCI_DEV_EVENTS(ctx) + 2)
+			break;
+
+		pthread_mutex_lock(&pdev[i]->lock);
+
+		if (pdev[i]->fd >= 0)
+			events += ugci_dev_events(pdev[i], pfd[i * 2].revents,
+						  ctx->read_budget, &more);
+
+		if (pdev[i]->fd >= 0 && (pfd[i * 2 + 1].revents & POLLIN))
+			events += ugci_dev_timers(pdev[i]);
+
+		pthread_mutex_unlock(&pdev[i]->lock);
+	}
+
+	return events;
+}
+
+/* Wait for and decode whatever the devices have into the event queue */
+static int __ugci_gather(struct ugci_ctx *ctx, int timeout)
+{
+	if (ctx->epfd >= 0)
+		return ugci_wait_epoll(ctx, timeout);
+	else
+		return ugci_wait_poll(ctx, timeout);
+}
+
+/* A spin window doubles each time it catches something and halves each
+ * time it runs out, staying between a 16th of the limit and the limit. So
+ * a busy board keeps us spinning, and an idle one soon stops costing much. */
+static unsigned long long ugci_spin_window(unsigned long long spin, int us)
+{
+	unsigned long long max = us * 1000ULL;
+
+	if (spin > max)
+		return max;
+	if (spin < max / 16)
+		return max / 16;
+
+	return spin;
+}
+
+/* In low-latency mode, keep gathering without blocking for a while before
+ * going to sleep. Whatever time it spins comes off the timeout. */
+static int ugci_gather(struct ugci_ctx *ctx, int timeout)
+{
+	int n, us = __atomic_load_n(&ctx->ll_spin, __ATOMIC_RELAXED);
+	unsigned long long start, spent, spin;
+
+	if (!us || !timeout)
+		return __ugci_gather(ctx, timeout);
+
+	spin = ugci_spin_window(ctx->gather_spin, us);
+	start = ugci_now();
+
+	do {
+		if ((n = __ugci_gather(ctx, 0)) != 0) {
+			ctx->gather_spin = ugci_spin_window(spin * 2, us);
+			return n;
+		}
+		spent = ugci_now() - start;
+	} while (spent < spin);
+
+	ctx->gather_spin = ugci_spin_window(spin / 2, us);
+
+	if (timeout > 0 && (timeout -= spent / 1000000) <= 0)
+		return 0;
+
+	return __ugci_gather(ctx, timeout);
+}
+
+static void ugci_drain_append(struct ugci_ctx *ctx, struct ugci_ring *ring)
+{
+	ring->next = NULL;
+
+	if (ctx->drain_tail)
+		ctx->drain_tail->next = ring;
+	else
+		ctx->drain_head = ring;
+	ctx->drain_tail = ring;
+}
+
+static inline int ugci_ring_empty(struct ugci_ring *ring)
+{
+	return ring->head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
+
+/* Take an empty ring off the drain list. prev is the ring before it, or
+ * NULL if it is the first. */
+static void ugci_drain_remove(struct ugci_ctx *ctx, struct ugci_ring *prev,
+			      struct ugci_ring *ring)
+{
+	if (prev)
+		prev->next = ring->next;
+	else
+		ctx->drain_head = ring->next;
+	if (ctx->drain_tail == ring)
+		ctx->drain_tail = prev;
+
+	/* Either we see what was pushed after we emptied it, or the reader
+	 * thread sees it is not queued and queues it */
+	__atomic_store_n(&ring->queued, 0, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) != ring->head &&
+	    ! __atomic_exchange_n(&ring->queued, 1, __ATOMIC_SEQ_CST))
+		ugci_drain_append(ctx, ring);
+}
+
+static inline unsigned long long ugci_ring_time(struct ugci_ring *ring)
+{
+	return ring->ev[ring->head & (ring->size - 1)].time;
+}
+
+static void ugci_merge_sift(struct ugci_ring **heap, int k, int i)
+{
+	struct ugci_ring *ring = heap[i];
+	int c;
+
+	while ((c = i * 2 + 1) < k) {
+		if (c + 1 < k && ugci_ring_time(heap[c + 1]) < ugci_ring_time(heap[c]))
+			c++;
+		if (ugci_ring_time(ring) <= ugci_ring_time(heap[c]))
+			break;
+		heap[i] = heap[c];
+		i = c;
+	}
+
+	heap[i] = ring;
+}
+
+/* Only the rings that have had something pushed since they were last
+ * emptied are looked at, so this does not grow with the device table.
+ *
+ * Each ring is in time order, but they are only kept per board, so they
+ * are merged back together here with a heap on the time at the head of
+ * each ring. The oldest ring gives up everything older than the next
+ * oldest head, and boards tend to come in runs, so that is usually a few
+ * events each time round.
+ *
+ * The reader thread stamps events as it reads them, one board at a time,
+ * so they are pushed in time order. It is only an event that shows up in
+ * a ring after we took the ready stack that could be newer than one that
+ * is not in our list yet, so anything newer than the reader had finished
+ * pushing beforehand is left for next time. That is held back no longer
+ * than it takes the reader thread to get from one push to the next. */
+static int ugci_reader_drain(struct ugci_ctx *ctx, struct ugci_event *out, int max)
+{
+	struct ugci_ring *ring, *next, *prev, *list = NULL, **heap;
+	unsigned long long until, horizon;
+	int i, k = 0, n = 0;
+
+	horizon = __atomic_load_n(&ctx->reader_time, __ATOMIC_ACQUIRE);
+
+	/* The ready stack is newest first */
+	ring = __atomic_exchange_n(&ctx->ready, NULL, __ATOMIC_ACQUIRE);
+	for (; ring; ring = next) {
+		next = ring->next;
+		ring->next = list;
+		list = ring;
+	}
+	for (; list; list = next) {
+		next = list->next;
+		ugci_drain_append(ctx, list);
+	}
+
+	for (prev = NULL, ring = ctx->drain_head; ring; ring = next) {
+		next = ring->next;
+
+		if (ugci_ring_empty(ring)) {
+			ugci_drain_remove(ctx, prev, ring);
+			continue;
+		}
+		prev = ring;
+
+		if (ugci_ring_time(ring) > horizon)
+			continue;
+
+		if (k == ctx->merge_size) {
+			int size = k ? k * 2 : UGCI_DEVS_INIT;
+
+			if (!(heap = realloc(ctx->merge, size * sizeof(*heap))))
+				break;
+			ctx->merge = heap;
+			ctx->merge_size = size;
+		}
+		ctx->merge[k++] = ring;
+	}
+
+	heap = ctx->merge;
+	for (i = k / 2 - 1; i >= 0; i--)
+		ugci_merge_sift(heap, k, i);
+
+	while (n < max && k) {
+		until = horizon;
+		if (k > 1 && ugci_ring_time(heap[1]) < until)
+			until = ugci_ring_time(heap[1]);
+		if (k > 2 && ugci_ring_time(heap[2]) < until)
+			until = ugci_ring_time(heap[2]);
+
+		n += ugci_ring_pop(heap[0], out + n, max - n, until);
+
+		if (ugci_ring_empty(heap[0]) || ugci_ring_time(heap[0]) > horizon)
+			heap[0] = heap[--k];
+		if (k)
+			ugci_merge_sift(heap, k, 0);
+	}
+
+	/* Whatever we emptied comes off the list */
+	for (prev = NULL, ring = ctx->drain_head; ring; ring = next) {
+		next = ring->next;
+
+		if (ugci_ring_empty(ring))
+			ugci_drain_remove(ctx, prev, ring);
+		else
+			prev = ring;
+	}
+
+	return n;
+}
+
+/* Consumer side of threaded mode. Only if there is nothing in the rings
+ * and we are allowed to wait do we make any syscalls. */
+static int ugci_reader_events(struct ugci_ctx *ctx, struct ugci_event *out,
+			      int max, int timeout)
+{
+	struct pollfd pfd = { .fd = ctx->reader_notify_fd, .events = POLLIN };
+	unsigned long long start, spent, spin;
+	uint64_t val;
+	int n, us;
+
+	if ((n = ugci_reader_drain(ctx, out, max)))
+		return n;
+	if (__atomic_load_n(&ctx->reader_done, __ATOMIC_SEQ_CST))
+		return -1;
+	if (!timeout)
+		return 0;
+
+	/* Low-latency mode spins on the rings first, the same way as
+	 * ugci_gather() */
+	if ((us = __atomic_load_n(&ctx->ll_spin, __ATOMIC_RELAXED))) {
+		spin = ugci_spin_window(ctx->consume_spin, us);
+		start = ugci_now();
+
+		do {
+			if ((n = ugci_reader_drain(ctx, out, max))) {
+				ctx->consume_spin = ugci_spin_window(spin * 2, us);
+				return n;
 			}
+			spent = ugci_now() - start;
+		} while (spent < spin);
+
+		ctx->consume_spin = ugci_spin_window(spin / 2, us);
+
+		if (timeout > 0 && (timeout -= spent / 1000000) <= 0)
+			return 0;
+	}
+
+	/* Pairs with the fence in ugci_reader_main() so that either we see
+	 * its events, or it sees us waiting and wakes us up. */
+	__atomic_store_n(&ctx->consumer_waiting, 1, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	if (!(n = ugci_reader_drain(ctx, out, max))) {
+		if (poll(&pfd, 1, timeout) > 0 &&
+		    read(ctx->reader_notify_fd, &val, sizeof(val)) < 0)
+			DPRINT("UGCI: Reader notify read failed\n");
+
+		n = ugci_reader_drain(ctx, out, max);
+	}
+
+	__atomic_store_n(&ctx->consumer_waiting, 0, __ATOMIC_SEQ_CST);
+
+	/* Rather than waiting again for a thread that has stopped */
+	if (!n && __atomic_load_n(&ctx->reader_done, __ATOMIC_SEQ_CST))
+		return -1;
+
+	return n;
+}
+
+static int ugci_have_events(struct ugci_ctx *ctx)
+{
+	if (ctx->bus)
+		return ugci_bus_pending(ctx);
+	if (ctx->reader_running)
+		return ctx->drain_head || __atomic_load_n(&ctx->ready, __ATOMIC_ACQUIRE);
+
+	return ctx->evq_head != ctx->evq_tail;
+}
+
+/* The device an event came from, for its stats. They tend to come in runs
+ * from the same one, so the last is tried first. */
+/* Catch up with the slot table, the first time an ID is seen */
+static struct ugci_dev_info *ugci_stat_slot(struct ugci_ctx *ctx, int id)
+{
+	struct ugci_dev_info **devs;
+	int n;
+
+	pthread_mutex_lock(&ctx->devs_lock);
+	n = ctx->ndevs;
+	if (n > ctx->stat_ndevs &&
+	    (devs = realloc(ctx->stat_devs, n * sizeof(*devs)))) {
+		memcpy(devs, ctx->devs, n * sizeof(*devs));
+		ctx->stat_devs = devs;
+		ctx->stat_ndevs = n;
+	}
+	pthread_mutex_unlock(&ctx->devs_lock);
+
+	return id < ctx->stat_ndevs ? ctx->stat_devs[id] : NULL;
+}
+
+/* Slots never move, so once the consumer has a copy of one it can keep
+ * it. A bus client has no boards to count for. Called with the poll lock
+ * held. */
+static inline struct ugci_dev_info *ugci_event_dev(struct ugci_ctx *ctx,
+						   struct ugci_dev_info *last,
+						   const struct ugci_event *event)
+{
+	int id = event->id / 2;
+
+	if (last && last->id == id)
+		return last;
+
+	if (ctx->bus || id < 0)
+		return NULL;
+
+	if (id < ctx->stat_ndevs)
+		return ctx->stat_devs[id];
+
+	return ugci_stat_slot(ctx, id);
+}
+
+/* From the read (or the deadline, for a coin release) to being handed
+ * out. Called with the poll lock held. */
+static void ugci_stat_dispatch(struct ugci_ctx *ctx, const struct ugci_event *out, int n)
+{
+	struct ugci_dev_info *dev = NULL;
+	unsigned long long now;
+	int i;
+
+	if (n <= 0)
+		return;
+
+	now = ugci_now();
+
+	for (i = 0; i < n; i++) {
+		if ((dev = ugci_event_dev(ctx, dev, &out[i])))
+			ugci_stat_hist(dev->stats.dispatch_latency,
+				       now > out[i].time ? now - out[i].time : 0);
+	}
+}
+
+/* Called with the poll lock held */
+static int __ugci_poll_events(struct ugci_ctx *ctx, struct ugci_event *out,
+			      int max, int timeout)
+{
+	int n;
+
+	/* The reader thread's rings may still have the removal events,
+	 * it says when they are gone */
+	if (! ctx->initialized && ! ctx->reader_running)
+		return -1;
+
+	if (ctx->bus) {
+		n = ugci_bus_events(ctx, out, max, timeout);
+	} else if (ctx->reader_running) {
+		n = ugci_reader_events(ctx, out, max, timeout);
+	} else {
+		/* Leftovers from last time go out first, without waiting */
+		if (ctx->evq_head == ctx->evq_tail)
+			ugci_gather(ctx, timeout);
+
+		for (n = 0; n < max && ctx->evq_head != ctx->evq_tail; n++)
+			out[n] = ctx->evq[ctx->evq_head++ & (ctx->evq_size - 1)];
+	}
+
+	ugci_stat_dispatch(ctx, out, n);
+
+	if (ctx->bus_out && n > 0)
+		ugci_bus_publish(ctx, out, n);
+
+	return n;
+}
+
+int ugci_ctx_poll_events(struct ugci_ctx *ctx, struct ugci_event *out, int max, int timeout)
+{
+	int n;
+
+	pthread_mutex_lock(&ctx->poll_lock);
+	n = __ugci_poll_events(ctx, out, max, timeout);
+	pthread_mutex_unlock(&ctx->poll_lock);
+
+	return n;
+}
+
+/* The callback runs with the poll lock held */
+int ugci_ctx_poll(struct ugci_ctx *ctx, int timeout)
+{
+	struct ugci_event batch[64];
+	struct ugci_dev_info *dev = NULL;
+	unsigned long long start;
+	int i, n, events = 0;
+
+	pthread_mutex_lock(&ctx->poll_lock);
+
+	while ((n = __ugci_poll_events(ctx, batch, 64, timeout)) > 0) {
+		for (i = 0; i < n; i++) {
+			if (!ctx->cb && !ctx->event_cb)
+				continue;
+
+			start = ugci_now();
+			ugci_send_event(ctx, &batch[i]);
+
+			if ((dev = ugci_event_dev(ctx, dev, &batch[i])))
+				ugci_stat_hist(dev->stats.callback_time, ugci_now() - start);
 		}
 
-		/* Now check watchdog timer */
-		if (dev->wd_interval) {
-			int checktime = (dev->wd_interval / 2) ?: 1;
+		events += n;
 
-			if (dev->last_wd + checktime <= time(NULL)) {
-				int old_info = info_out;
-				info_out = 0;
-				ugci_set_watchdog(dev->id, UGCI_WD_RUNTIME, dev->wd_interval);
-				info_out = old_info;
-			}
+		/* Only wait the one time */
+		if (! ugci_have_events(ctx))
+			break;
+	}
+
+	pthread_mutex_unlock(&ctx->poll_lock);
+
+	return (n < 0 && !events) ? n : events;
+}
+
+static void *ugci_reader_main(void *arg)
+{
+	struct ugci_ctx *ctx = arg;
+	uint64_t one = 1;
+
+	while (! __atomic_load_n(&ctx->reader_stop, __ATOMIC_ACQUIRE)) {
+		/* The last device went away */
+		if (! ctx->initialized) {
+			__atomic_store_n(&ctx->reader_done, 1, __ATOMIC_SEQ_CST);
+			break;
 		}
+
+		if (ugci_gather(ctx, -1) <= 0)
+			continue;
+
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&ctx->consumer_waiting, __ATOMIC_SEQ_CST) &&
+		    write(ctx->reader_notify_fd, &one, sizeof(one)) < 0)
+			DPRINT("UGCI: Reader notify write failed\n");
 	}
 
-	return events;
+	/* Whoever is waiting gets the removal events, and then finds out.
+	 * This one is left readable, so a later wait doesn't block either. */
+	if (__atomic_load_n(&ctx->reader_done, __ATOMIC_SEQ_CST) &&
+	    write(ctx->reader_notify_fd, &one, sizeof(one)) < 0)
+		DPRINT("UGCI: Reader notify write failed\n");
+
+	return NULL;
+}
+
+/* Put back whatever the thread had before we changed it */
+static int ugci_ll_restore(struct ugci_ctx *ctx)
+{
+	int ret = 0;
+
+	if ((ctx->ll_changed & UGCI_LL_SCHED) &&
+	    pthread_setschedparam(ctx->ll_thread, ctx->ll_policy, &ctx->ll_param))
+		ret = -1;
+
+	if ((ctx->ll_changed & UGCI_LL_CPU) &&
+	    pthread_setaffinity_np(ctx->ll_thread, sizeof(ctx->ll_set), &ctx->ll_set))
+		ret = -1;
+
+	ctx->ll_changed = 0;
+
+	return ret;
+}
+
+/* Priority and CPU for a thread on the input path. Only what was asked for
+ * is changed, and what the thread had before is kept, so that it can go
+ * back when it is turned off or moves to another thread. Called with the
+ * poll lock held. */
+static int ugci_ll_thread(struct ugci_ctx *ctx, pthread_t thread)
+{
+	struct sched_param sp = { .sched_priority = ctx->ll_priority };
+	cpu_set_t set;
+	int ret = 0;
+
+	if (ctx->ll_changed && !pthread_equal(ctx->ll_thread, thread))
+		ret = ugci_ll_restore(ctx);
+
+	ctx->ll_thread = thread;
+
+	if (ctx->ll_priority > 0) {
+		if (!(ctx->ll_changed & UGCI_LL_SCHED) &&
+		    pthread_getschedparam(thread, &ctx->ll_policy, &ctx->ll_param))
+			return -1;
+		ctx->ll_changed |= UGCI_LL_SCHED;
+
+		if (pthread_setschedparam(thread, SCHED_FIFO, &sp))
+			ret = -1;
+	} else if (ctx->ll_changed & UGCI_LL_SCHED) {
+		if (pthread_setschedparam(thread, ctx->ll_policy, &ctx->ll_param))
+			ret = -1;
+		ctx->ll_changed &= ~UGCI_LL_SCHED;
+	}
+
+	if (ctx->ll_cpu >= 0) {
+		if (!(ctx->ll_changed & UGCI_LL_CPU) &&
+		    pthread_getaffinity_np(thread, sizeof(ctx->ll_set), &ctx->ll_set))
+			return -1;
+		ctx->ll_changed |= UGCI_LL_CPU;
+
+		CPU_ZERO(&set);
+		CPU_SET(ctx->ll_cpu, &set);
+		if (pthread_setaffinity_np(thread, sizeof(set), &set))
+			ret = -1;
+	} else if (ctx->ll_changed & UGCI_LL_CPU) {
+		if (pthread_setaffinity_np(thread, sizeof(ctx->ll_set), &ctx->ll_set))
+			ret = -1;
+		ctx->ll_changed &= ~UGCI_LL_CPU;
+	}
+
+	return ret;
+}
+
+/* Also cleans up after a partial ugci_ctx_start_reader(). Called with the
+ * poll lock held. */
+static void __ugci_stop_reader(struct ugci_ctx *ctx)
+{
+	uint64_t one = 1;
+	int i;
+
+	if (ctx->reader_running) {
+		__atomic_store_n(&ctx->reader_stop, 1, __ATOMIC_RELEASE);
+		if (write(ctx->reader_wake_fd, &one, sizeof(one)) < 0)
+			DPRINT("UGCI: Reader wakeup write failed\n");
+		pthread_join(ctx->reader_thread, NULL);
+		ctx->reader_running = 0;
+
+		/* What it had went with it */
+		if (ctx->ll_changed &&
+		    pthread_equal(ctx->ll_thread, ctx->reader_thread))
+			ctx->ll_changed = 0;
+	}
+
+	if (ctx->reader_wake_fd >= 0) {
+		if (ctx->epfd >= 0)
+			epoll_ctl(ctx->epfd, EPOLL_CTL_DEL, ctx->reader_wake_fd, NULL);
+		close(ctx->reader_wake_fd);
+		ctx->reader_wake_fd = -1;
+	}
+
+	if (ctx->reader_notify_fd >= 0) {
+		close(ctx->reader_notify_fd);
+		ctx->reader_notify_fd = -1;
+	}
+
+	/* Anything still in the rings is lost */
+	for (i = 0; i < ctx->ndevs; i++) {
+		free(ctx->devs[i]->ring);
+		ctx->devs[i]->ring = NULL;
+	}
+
+	free(ctx->merge);
+	ctx->merge = NULL;
+	ctx->merge_size = 0;
+
+	ctx->ready = NULL;
+	ctx->drain_head = ctx->drain_tail = NULL;
+}
+
+int ugci_ctx_start_reader(struct ugci_ctx *ctx, int ring_size)
+{
+	struct ugci_dev_info **devs = ctx->devs;
+	unsigned int size = 64;
+	int i;
+
+	pthread_mutex_lock(&ctx->poll_lock);
+
+	if (! ctx->initialized || ctx->reader_running || ctx->epfd < 0) {
+		pthread_mutex_unlock(&ctx->poll_lock);
+		return -1;
+	}
+
+	while (size < ring_size)
+		size <<= 1;
+
+	if ((ctx->reader_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+		goto fail;
+	if ((ctx->reader_notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+		goto fail;
+	if (ugci_epoll_add(ctx, ctx->reader_wake_fd, &ctx->reader_wake_watch) < 0)
+		goto fail;
+
+	for (i = 0; i < ctx->ndevs; i++) {
+		if (devs[i]->fd < 0)
+			continue;
+
+		devs[i]->ring = calloc(1, sizeof(struct ugci_ring) +
+				       size * sizeof(struct ugci_event));
+		if (! devs[i]->ring)
+			goto fail;
+		devs[i]->ring->size = size;
+	}
+
+	ctx->reader_ring_size = size;
+	ctx->reader_stop = 0;
+	ctx->reader_done = 0;
+	if (pthread_create(&ctx->reader_thread, NULL, ugci_reader_main, ctx))
+		goto fail;
+
+	ctx->reader_running = 1;
+
+	if ((ctx->ll_priority > 0 || ctx->ll_cpu >= 0) &&
+	    ugci_ll_thread(ctx, ctx->reader_thread) && ctx->info_out)
+		printf("UGCI: Could not set up low-latency mode for the reader thread\n");
+
+	pthread_mutex_unlock(&ctx->poll_lock);
+
+	return 0;
+
+fail:
+	__ugci_stop_reader(ctx);
+	pthread_mutex_unlock(&ctx->poll_lock);
+	return -1;
+}
+
+void ugci_ctx_stop_reader(struct ugci_ctx *ctx)
+{
+	pthread_mutex_lock(&ctx->poll_lock);
+	__ugci_stop_reader(ctx);
+	pthread_mutex_unlock(&ctx->poll_lock);
+}
+
+int ugci_ctx_set_low_latency(struct ugci_ctx *ctx, int priority, int cpu, int spin_us)
+{
+	int on = priority > 0 || cpu >= 0 || spin_us > 0;
+	int ret = 0;
+
+	if (spin_us < 0)
+		return -1;
+
+	pthread_mutex_lock(&ctx->poll_lock);
+
+	ctx->ll_priority = priority;
+	ctx->ll_cpu = cpu;
+	__atomic_store_n(&ctx->ll_spin, spin_us, __ATOMIC_RELAXED);
+
+	/* So that a page fault cannot stall the input path */
+	if (on && ! ctx->ll_locked) {
+		if (mlockall(MCL_CURRENT | MCL_FUTURE))
+			ret = -1;
+		else
+			ctx->ll_locked = 1;
+	} else if (!on && ctx->ll_locked) {
+		munlockall();
+		ctx->ll_locked = 0;
+	}
+
+	if (ugci_ll_thread(ctx, ctx->reader_running ? ctx->reader_thread :
+			   pthread_self()))
+		ret = -1;
+
+	if (ret && ctx->info_out)
+		printf("UGCI: Could not set up all of low-latency mode\n");
+
+	pthread_mutex_unlock(&ctx->poll_lock);
+
+	return ret;
+}
+
+int ugci_ctx_get_reader_stats(struct ugci_ctx *ctx, int id, struct ugci_reader_stats *stats)
+{
+	struct ugci_dev_info *dev = ugci_lock_dev(ctx, id);
+	struct ugci_ring *ring;
+
+	if (!dev)
+		return -1;
+
+	if (!(ring = dev->ring)) {
+		ugci_unlock_dev(dev);
+		return -1;
+	}
+
+	stats->size = ring->size;
+	stats->high_water = __atomic_load_n(&ring->high_water, __ATOMIC_RELAXED);
+	stats->events = __atomic_load_n(&ring->pushed, __ATOMIC_RELAXED);
+	stats->overflows = __atomic_load_n(&ring->overflows, __ATOMIC_RELAXED);
+
+	ugci_unlock_dev(dev);
+
+	return 0;
+}
+
+/* The counters are read as they are, without stopping anything, so they
+ * can be a little out of step with each other */
+int ugci_ctx_get_stats(struct ugci_ctx *ctx, int id, struct ugci_stats *stats)
+{
+	struct ugci_dev_info *dev = ugci_get_slot(ctx, id);
+	unsigned long long *out = (unsigned long long *)stats;
+	unsigned long long *in;
+	int i;
+
+	if (!dev)
+		return -1;
+
+	/* Nothing but unsigned long longs in there */
+	in = (unsigned long long *)&dev->stats;
+	for (i = 0; i < sizeof(*stats) / sizeof(*out); i++)
+		out[i] = __atomic_load_n(&in[i], __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+int ugci_ctx_get_fd(struct ugci_ctx *ctx)
+{
+	int fd;
+
+	if (! ctx->initialized || ctx->reader_running)
+		return -1;
+
+	if (ctx->bus) {
+		pthread_mutex_lock(&ctx->poll_lock);
+		fd = ctx->bus ? ugci_bus_get_fd(ctx) : -1;
+		pthread_mutex_unlock(&ctx->poll_lock);
+		return fd;
+	}
+
+	return ctx->epfd;
+}
+
+int ugci_ctx_dispatch(struct ugci_ctx *ctx)
+{
+	return ugci_ctx_poll(ctx, 0);
+}
+
+
+/* The original API works on this one */
+static struct ugci_ctx default_ctx;
+static pthread_once_t default_once = PTHREAD_ONCE_INIT;
+
+static void ugci_default_setup(void)
+{
+	ugci_ctx_setup(&default_ctx);
+}
+
+static inline struct ugci_ctx *ugci_default(void)
+{
+	pthread_once(&default_once, ugci_default_setup);
+	return &default_ctx;
+}
+
+int ugci_set_cache(const char *path)
+{
+	return ugci_ctx_set_cache(ugci_default(), path);
+}
+
+int ugci_set_backend(int type)
+{
+	return ugci_ctx_set_backend(ugci_default(), type);
+}
+
+int ugci_init(ugci_callback_t cb, unsigned int mask, int info)
+{
+	return ugci_ctx_init(ugci_default(), cb, mask, info);
+}
+
+void ugci_close(void)
+{
+	ugci_ctx_close(ugci_default());
+}
+
+int ugci_poll(int timeout)
+{
+	return ugci_ctx_poll(ugci_default(), timeout);
+}
+
+int ugci_poll_events(struct ugci_event *out, int max, int timeout)
+{
+	return ugci_ctx_poll_events(ugci_default(), out, max, timeout);
+}
+
+int ugci_start_reader(int ring_size)
+{
+	return ugci_ctx_start_reader(ugci_default(), ring_size);
+}
+
+void ugci_stop_reader(void)
+{
+	ugci_ctx_stop_reader(ugci_default());
+}
+
+int ugci_get_reader_stats(int id, struct ugci_reader_stats *stats)
+{
+	return ugci_ctx_get_reader_stats(ugci_default(), id, stats);
+}
+
+int ugci_set_low_latency(int priority, int cpu, int spin_us)
+{
+	return ugci_ctx_set_low_latency(ugci_default(), priority, cpu, spin_us);
+}
+
+int ugci_set_read_buffer(int urefs, int budget)
+{
+	return ugci_ctx_set_read_buffer(ugci_default(), urefs, budget);
+}
+
+int ugci_record(const char *path)
+{
+	return ugci_ctx_record(ugci_default(), path);
+}
+
+int ugci_publish(const char *name, int size)
+{
+	return ugci_ctx_publish(ugci_default(), name, size);
+}
+
+int ugci_get_stats(int id, struct ugci_stats *stats)
+{
+	return ugci_ctx_get_stats(ugci_default(), id, stats);
+}
+
+int ugci_enable_hotplug(void)
+{
+	return ugci_ctx_enable_hotplug(ugci_default());
+}
+
+int ugci_get_fd(void)
+{
+	return ugci_ctx_get_fd(ugci_default());
+}
+
+int ugci_dispatch(void)
+{
+	return ugci_ctx_dispatch(ugci_default());
+}
+
+int ugci_get_coin_count(int id, unsigned short *count)
+{
+	return ugci_ctx_get_coin_count(ugci_default(), id, count);
+}
+
+int ugci_get_snapshot(int id, struct ugci_board_state *state)
+{
+	return ugci_ctx_get_snapshot(ugci_default(), id, state);
+}
+
+int ugci_get_state(struct ugci_player_state *out, int max)
+{
+	return ugci_ctx_get_state(ugci_default(), out, max);
+}
+
+void ugci_set_event_callback(ugci_event_callback_t cb, void *data)
+{
+	ugci_ctx_set_event_callback(ugci_default(), cb, data);
+}
+
+void ugci_set_coin_simulate(int wait_time)
+{
+	ugci_ctx_set_coin_simulate(ugci_default(), wait_time);
+}
+
+int ugci_set_secblk(int id, unsigned char values[UGCI_SEC_VALUES])
+{
+	return ugci_ctx_set_secblk(ugci_default(), id, values);
+}
+
+int ugci_get_secblk(int id, unsigned char values[UGCI_SEC_VALUES])
+{
+	return ugci_ctx_get_secblk(ugci_default(), id, values);
+}
+
+int ugci_set_watchdog(int id, int type, unsigned short seconds)
+{
+	return ugci_ctx_set_watchdog(ugci_default(), id, type, seconds);
+}
+
+int ugci_kbd_mode(int id, int mode, unsigned char delay)
+{
+	return ugci_ctx_kbd_mode(ugci_default(), id, mode, delay);
+}
+
+int ugci_start_writer(void)
+{
+	return ugci_ctx_start_writer(ugci_default());
+}
+
+void ugci_stop_writer(void)
+{
+	ugci_ctx_stop_writer(ugci_default());
+}
+
+void ugci_set_command_callback(ugci_command_callback_t cb, void *data)
+{
+	ugci_ctx_set_command_callback(ugci_default(), cb, data);
+}
+
+int ugci_queue_watchdog(int id, int type, unsigned short seconds)
+{
+	return ugci_ctx_queue_watchdog(ugci_default(), id, type, seconds);
+}
+
+int ugci_queue_kbd_mode(int id, int mode, unsigned char delay)
+{
+	return ugci_ctx_queue_kbd_mode(ugci_default(), id, mode, delay);
+}
+
+int ugci_queue_secblk(int id, unsigned char values[UGCI_SEC_VALUES])
+{
+	return ugci_ctx_queue_secblk(ugci_default(), id, values);
+}
+
+int ugci_start_watchdog(int priority)
+{
+	return ugci_ctx_start_watchdog(ugci_default(), priority);
+}
+
+void ugci_stop_watchdog(void)
+{
+	ugci_ctx_stop_watchdog(ugci_default());
+}
+
+int ugci_get_eeprom(int id, unsigned char *data, int *len)
+{
+	return ugci_ctx_get_eeprom(ugci_default(), id, data, len);
+}
+
+int ugci_load_eeproms(void)
+{
+	return ugci_ctx_load_eeproms(ugci_default());
+}
+
+int ugci_eeprom_status(int id)
+{
+	return ugci_ctx_eeprom_status(ugci_default(), id);
 }
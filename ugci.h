@@ -32,6 +32,16 @@ enum ugci_event_type {
 	UGCI_EVENT_COIN,		/* Coin button */
 	UGCI_EVENT_PLAY,		/* Play button */
 	UGCI_EVENT_WD,			/* Enable WD refresh in poll */
+	UGCI_EVENT_DEVICE,		/* Board attached or removed */
+	UGCI_EVENT_AXIS_X,		/* Joystick left/right */
+	UGCI_EVENT_AXIS_Y,		/* Joystick up/down */
+	UGCI_EVENT_BUTTON_1,		/* Joystick buttons, in order */
+	UGCI_EVENT_BUTTON_2,
+	UGCI_EVENT_BUTTON_3,
+	UGCI_EVENT_BUTTON_4,
+	UGCI_EVENT_BUTTON_5,
+	UGCI_EVENT_BUTTON_6,
+	UGCI_EVENT_BUTTON_7,
 };
 
 /* Maps the above enum to descriptive strings */
@@ -48,6 +58,20 @@ extern const char *ugci_id_to_name[];
 /* The play button event sends 1 for press and 0 for release.  */
 #define UGCI_EVENT_MASK_PLAY	0x0002
 
+/* Sent when a board is removed, or attached after ugci_init() (see
+ * ugci_enable_hotplug()). The ID is the first player on the board, and
+ * the value is 1 for attach and 0 for removal. */
+#define UGCI_EVENT_MASK_DEVICE	0x0004
+
+/* Boards with a joystick (driving, flying and fighting) report it on the
+ * same device as the coin and play buttons, so it comes through the same
+ * poll. The axis events send the position as the board reports it, and
+ * the button events (UGCI_EVENT_BUTTON_1 to 7) send 1 for press and 0 for
+ * release. Off by default, since not every game wants them, and a stick
+ * being moved around can send a lot of them. */
+#define UGCI_EVENT_MASK_AXIS	0x0008
+#define UGCI_EVENT_MASK_BUTTON	0x0010
+
 /* Prototype for the user supplied callback. This is called everytime an
  * event that matches the event mask is received. The ID is basically the
  * player number, base 0. The first UGCI device can send ID's 0 and 1,
@@ -55,9 +79,37 @@ extern const char *ugci_id_to_name[];
  * on the event. See the above mask defines for explanations of each.  */
 typedef void (*ugci_callback_t)(int id, enum ugci_event_type type, int value);
 
-/* Initializes the internal handlers. This will probe for UGCI devices and
- * open them. Returns the number of UGCI devices successfully probed and
- * opened. So the number of available players is twice this number. The
+/* One decoded event, as returned by ugci_poll_events(). The id, type and
+ * value are exactly what would be passed to the callback. The time is
+ * CLOCK_MONOTONIC in nanoseconds, taken as soon as the read() it came from
+ * returned, so it is the same for everything in one report. A simulated
+ * coin release (see ugci_set_coin_simulate()) has the time its deadline
+ * passed instead, not the time it was noticed. Events from all of the
+ * boards are handed out in time order, with or without the reader
+ * thread, apart from those coin releases. The time can be compared
+ * against clock_gettime(CLOCK_MONOTONIC) to measure latency. */
+struct ugci_event {
+	unsigned long long time;
+	int id;
+	enum ugci_event_type type;
+	int value;
+};
+
+/* Like ugci_callback_t, but with the whole event, timestamp included. The
+ * data is whatever was given to ugci_set_event_callback(). The event is
+ * only good until the callback returns. */
+typedef void (*ugci_event_callback_t)(const struct ugci_event *event, void *data);
+
+/* Use this callback instead of the one passed to ugci_init(). It can be
+ * set before or after ugci_init(), and the event mask given there still
+ * applies. A NULL cb goes back to the plain callback. Must not be called
+ * from within a callback. */
+void ugci_set_event_callback(ugci_event_callback_t cb, void *data);
+
+/* Initializes the internal handlers. This will probe every hiddev node
+ * present for UGCI devices and open them, however many there are.
+ * Returns the number of UGCI devices successfully probed and opened. So
+ * the number of available players is twice this number. The
  * callback is explained above. The mask is any ugci_event_type's you want
  * to be sent to the callback. The info is zero normally, but can be
  * non-zero if you want slightly verbose output during probe. This will
@@ -66,9 +118,106 @@ typedef void (*ugci_callback_t)(int id, enum ugci_event_type type, int value);
  * NOTE: it is possible to provide an empty mask or a NULL callback, or
  * both. It makes no sense to provide one without the other though. But
  * without the two, it is useful for just using some of the direct calls
- * into the devices (ugci_{get,set}_* for example).  */
+ * into the devices (ugci_{get,set}_* for example). Those are not there
+ * when it attaches to ugcid instead, see ugci_set_backend() below.  */
 int ugci_init(ugci_callback_t cb, unsigned int mask, int info);
 
+/* Select where ugci_init() looks for devices. Must be called before
+ * ugci_init(). The default is the kernel's hiddev interface. hidraw reads
+ * whole reports and only passes on what changed, which is a lot less to
+ * copy. What it passes on is decoded just as it is for hiddev. Before a
+ * 5.11 kernel, it can't read the coin counters until the board has sent
+ * something. If it finds no boards, ugci_init() falls back to hiddev. The
+ * simulated backend needs no hardware at all and is meant for load
+ * testing; see ugci_sim_config() below. The bus backend only attaches to
+ * ugcid, see ugci_publish().
+ *
+ * If no backend is set and ugcid is running, ugci_init() attaches to it
+ * instead of opening the boards, and returns the number of boards ugcid
+ * has. That only gives the events: every call for a board (coin count,
+ * security block, EEPROM, watchdog, keyboard mode, snapshot and stats, and
+ * the ugci_queue_*() ones) returns less than zero as if it was not there,
+ * ugci_get_state() finds no players, and ugci_enable_hotplug() and
+ * ugci_start_reader() return less than zero. A program that needs those
+ * has to set a backend. Returns less than zero if the
+ * backend is unknown or the library is already initialized. */
+int ugci_set_backend(int backend);
+
+#define UGCI_BACKEND_HIDDEV	0
+#define UGCI_BACKEND_SIM	1
+#define UGCI_BACKEND_REPLAY	2
+#define UGCI_BACKEND_HIDRAW	3
+#define UGCI_BACKEND_BUS	4
+
+/* Keep each board's EEPROM in a cache file between runs. Boards are known
+ * by their USB bus and device number, and a board found there again only
+ * has its security block read to make sure it is the same one, instead of
+ * the whole EEPROM. A changed security block just means a fresh read.
+ * The file is written when the EEPROMs have been loaded and by
+ * ugci_close(). Must be called before ugci_init(). A NULL path turns it
+ * off, which is the default. Returns less than zero on error. */
+int ugci_set_cache(const char *path);
+
+/* Configure the simulated backend. The number of boards is how many
+ * devices ugci_init() will find (two players each), and rate is how many
+ * input events per second each board generates, alternating play button
+ * presses/releases and coin drops across both players. A rate of 0 gives
+ * boards that never send anything, which is still useful for the direct
+ * calls. Each board keeps its own coin counters, security block and
+ * EEPROM. Must be called before ugci_init(). */
+int ugci_sim_config(int boards, unsigned int rate);
+
+/* Pull a simulated board out, in every context that has it open. Its next
+ * read fails the way a real board's does when it is unplugged, so it is
+ * removed (with a UGCI_EVENT_DEVICE event) by whoever is polling it.
+ * Returns less than zero if no such board is open. */
+int ugci_sim_unplug(int board);
+
+/* Record every read from every board to a file, exactly as it came in,
+ * with the time and which board it was from. Can be started and stopped
+ * (with a NULL path) at any time, and ugci_close() stops it too. The
+ * file is written through a buffer, so it is only complete once stopped.
+ * Returns less than zero if the file could not be created. */
+int ugci_record(const char *path);
+
+/* Configure the replay backend, which plays a file from ugci_record()
+ * back in through ugci_poll() and friends. Each board in the recording
+ * comes back as a board, and the event mask, coin release simulation and
+ * so on all work just as they did live. The coin counters and buttons
+ * read back as whatever the recording last said. The security block and
+ * EEPROM read as zero, and anything sent to the boards is dropped. With
+ * realtime set, reads come back at the same pace as they were recorded.
+ * Otherwise they come back as fast as they are polled for. Either way,
+ * each board goes quiet once it has played everything it recorded. Must
+ * be called before ugci_init(). */
+int ugci_replay_config(const char *path, int realtime);
+
+/* Only one process can own the boards. This makes every event that this
+ * one hands out (from ugci_poll() and friends, within its event mask)
+ * available to other processes too, through a ring of size events in
+ * shared memory of the given name, which is what ugcid does. Each of
+ * them gets every event, in its own event mask, with no syscalls unless
+ * it has to wait for one. One that falls a whole ring behind loses the
+ * oldest. They have no boards of their own, so only the events work; the
+ * calls that talk to a board fail. Once the publisher stops, or within a
+ * second of it being killed, they get less than zero from ugci_poll()
+ * like any other shutdown. The shared memory is mode 0660. A
+ * NULL name stops publishing, and ugci_close() stops it too. Returns less
+ * than zero if it could not be set up, or something else is already
+ * publishing with that name. */
+int ugci_publish(const char *name, int size);
+
+#define UGCI_BUS_NAME		"/ugcid"
+
+/* How each board is read when it has something. Every read takes up to
+ * urefs usage refs (the default is 64). Reads are repeated until there is
+ * nothing left, but no more than budget times per wakeup (the default is
+ * 4), so that one very busy board can not starve the others. The ready
+ * boards take turns, a read at a time. Whatever is left is read on the
+ * next poll. Zero for either one keeps the default.
+ * Must be called before ugci_init(). Returns less than zero on error. */
+int ugci_set_read_buffer(int urefs, int budget);
+
 /* Shutdown and close the UGCI system. */
 void ugci_close(void);
 
@@ -82,16 +231,174 @@ unsigned int ugci_get_version(void);
  * the number of events processed. */
 int ugci_poll(int timeout);
 
+/* Like ugci_poll(), but instead of calling the callback, fills in up to
+ * max events in the out array so a game loop can handle a whole frame's
+ * input at once. Events that do not fit are returned by the next call,
+ * which then does not wait. The event mask given to ugci_init() still
+ * applies. Returns the number of events stored, or less than zero if the
+ * library is not initialized. ugci_poll() is just this plus the callback,
+ * so the two can be mixed. */
+int ugci_poll_events(struct ugci_event *out, int max, int timeout);
+
+/* Threaded mode. Starts a background thread that blocks on the devices,
+ * decodes events and pushes them into a lock-free ring per device.
+ * ugci_poll() and ugci_poll_events() then just drain the rings, and make
+ * no syscalls at all unless there is nothing there and they are asked to
+ * wait. The ring_size is the number of events each ring can hold, and is
+ * rounded up to a power of 2 (minimum 64). Events that arrive while a ring
+ * is full are dropped and counted, see ugci_get_reader_stats(). The
+ * watchdog refresh and coin release simulation are handled by the thread
+ * too. ugci_get_fd() is not available in this mode. Returns less than zero
+ * on error. */
+int ugci_start_reader(int ring_size);
+
+/* Stops the reader thread. Events still in the rings are discarded. This
+ * is done by ugci_close() as well. */
+void ugci_stop_reader(void);
+
+struct ugci_reader_stats {
+	unsigned long long events;	/* Total pushed into the ring */
+	unsigned long long overflows;	/* Dropped because it was full */
+	unsigned int high_water;	/* Most events ever waiting */
+	unsigned int size;		/* Capacity of the ring */
+};
+
+/* Ring statistics for the device (not player) ID, for sizing the rings.
+ * Only valid while the reader thread is running. */
+int ugci_get_reader_stats(int id, struct ugci_reader_stats *stats);
+
+/* Low-latency mode, for when the time from a button press to the callback
+ * matters more than CPU. The thread on the input path (the reader thread
+ * if it is running or started later, otherwise whoever calls this, which
+ * should be the thread calling ugci_poll()) is made SCHED_FIFO at priority
+ * if it is above zero, and pinned to cpu if it is not -1. Memory is locked
+ * with mlockall(). Waiting for events spins without blocking for up to
+ * spin_us microseconds first, for less as long as the spin keeps coming up
+ * empty. Only what is asked for is changed, and a priority or CPU that is
+ * dropped again, or 0, -1, 0 to turn it all off, puts back what the thread
+ * had before. Returns less than zero if any of it could not be done, which
+ * usually means we are not allowed; the rest is still set up. */
+int ugci_set_low_latency(int priority, int cpu, int spin_us);
+
+#define UGCI_STATS_BUCKETS	20
+
+/* Histograms have a bucket per power of two microseconds. Bucket 0 is
+ * under 1us, bucket n is 2^(n-1)us up to 2^n us, and the last one also
+ * gets everything longer. */
+struct ugci_stats {
+	unsigned long long reads;		/* Reads that returned data */
+	unsigned long long bytes;		/* Total returned by them */
+	unsigned long long full_reads;		/* Filled the buffer */
+	unsigned long long events;		/* Decoded and queued */
+	unsigned long long filtered;		/* Decoded, but not in the mask */
+	unsigned long long forced_releases;	/* Coin releases sent early */
+	unsigned long long wd_refreshes;	/* Watchdog refreshes sent */
+	unsigned long long commands;		/* Sent by the writer thread */
+	unsigned long long coalesced;		/* Replaced while queued */
+	unsigned long long wd_missed;		/* Refreshes sent too late */
+	/* Closest a refresh came to the board's deadline, in ns, or 0 if
+	 * there has been none yet. Refreshes queued for the writer thread
+	 * are not counted here or above. */
+	unsigned long long wd_min_slack;
+
+	/* From the read to the event being handed out */
+	unsigned long long dispatch_latency[UGCI_STATS_BUCKETS];
+	/* Time spent in the callback, per event */
+	unsigned long long callback_time[UGCI_STATS_BUCKETS];
+	/* How late each watchdog refresh was */
+	unsigned long long wd_jitter[UGCI_STATS_BUCKETS];
+	/* From queuing a command to it being sent */
+	unsigned long long command_latency[UGCI_STATS_BUCKETS];
+};
+
+/* Counters for the device (not player) ID, kept all the time. They are
+ * cheap enough to leave on: no locks past the first event from each
+ * board, no atomic read-modify-writes, one extra clock read for each
+ * batch of events handed out, and two around each callback. They cover the ID since the context was created, so a board
+ * that is unplugged and comes back keeps adding to them. Readable from
+ * any thread at any time. Returns less than zero if there is no such
+ * device. */
+int ugci_get_stats(int id, struct ugci_stats *stats);
+
+/* For applications with their own event loop. Returns a file descriptor
+ * that polls readable (POLLIN/EPOLLIN) whenever any UGCI device has data,
+ * or a coin release or watchdog refresh is due. Add it to your own
+ * poll/epoll/libuv/glib loop and call ugci_dispatch() when it fires. Do
+ * not read from or close it. Attached to ugcid, it is an eventfd that a
+ * thread of the library's own keeps readable while the bus has events.
+ * Returns less than zero if the library is not
+ * initialized, or no epoll instance could be created, in which
+ * case you must keep calling ugci_poll(). */
+int ugci_get_fd(void);
+
+/* Process whatever is ready right now, without blocking. This triggers
+ * callbacks exactly like ugci_poll() and returns the number of events
+ * processed. */
+int ugci_dispatch(void);
+
+/* Watch for boards being plugged in and removed, using kernel/udev
+ * uevents, so that a board re-enumerated after a USB hiccup comes back
+ * without ugci_close() and ugci_init(). A board that returns on the same
+ * USB port gets back the player IDs it had before. New boards take the
+ * first free IDs. Only supported with the hiddev and hidraw backends.
+ * With this enabled, ugci_poll() keeps working even when every board is
+ * gone. Returns less than zero on error. */
+int ugci_enable_hotplug(void);
+
 /* Get the coin count for a particular Player ID. ID is the same as would
  * be passed to the callback routine. */
 int ugci_get_coin_count(int id, unsigned short *count);
 
+struct ugci_board_state {
+	unsigned short coins[2];	/* Coin counter for each player */
+	int play[2];			/* 1 if the play button is down */
+};
+
+/* Current coin counters and play buttons for both players on the device
+ * (not player) ID, read together. For startup and reconciliation, instead
+ * of asking for each player separately. Returns less than zero on
+ * error. */
+int ugci_get_snapshot(int id, struct ugci_board_state *state);
+
+struct ugci_player_state {
+	unsigned short coins;		/* Coin counter */
+	int play;			/* 1 if the play button is down */
+	int present;			/* 1 if the board is attached */
+	int axis_x;			/* Joystick position */
+	int axis_y;
+	unsigned int buttons;		/* Bit 0 is button 1, and so on */
+
+	/* Each of these goes up by one every time its field changes */
+	unsigned int coins_seq;
+	unsigned int play_seq;
+	unsigned int present_seq;
+	unsigned int axis_x_seq;
+	unsigned int axis_y_seq;
+	unsigned int buttons_seq;
+};
+
+/* The current input state of every player, for games that would rather
+ * look once a frame than handle events. Copies up to max players into
+ * out, indexed by player ID, all from the same instant. Takes no locks
+ * and makes no syscalls (unless it catches the table half updated, when it
+ * yields and tries again), so it can be called from any thread as often
+ * as needed. Returns the number of players there are, which may be more
+ * than max.
+ *
+ * The table is updated wherever input is read, whatever the event mask
+ * is. That is ugci_poll() and friends, or the reader thread if it is
+ * running, in which case nothing else has to be called at all. A field's
+ * sequence number moving on since the last frame means it changed, even
+ * if it has changed back since (a quick tap of the play button, say). */
+int ugci_get_state(struct ugci_player_state *out, int max);
+
 /* This will simulate a release event for the coin button. Internally, the
  * coin button only returns press events, since it is really just an
  * absolute counter. Setting the wait time, will produce a release event
- * after wait_time milliseconds has passed. This relies on the fact that
- * you actually call ugci_poll() as frequently as this value. Set this to
- * 0 in order to disable, which is the default.
+ * after wait_time milliseconds has passed. The release is driven by a
+ * timer in the same wait set as the devices, so it is delivered on time
+ * even if you poll with an infinite timeout. Set this to 0 in order to
+ * disable, which is the default.
  *
  * It is possible that you will receive press/release events faster than
  * this value. The fact that the coin button is a counter only means that
@@ -110,18 +417,32 @@ int ugci_set_secblk(int id, unsigned char values[UGCI_SEC_VALUES]);
 int ugci_get_secblk(int id, unsigned char values[UGCI_SEC_VALUES]);
 
 
-/* Start a watchdog thread. The seconds is what is reported to UGCI. The
+/* Set a watchdog timer. The seconds is what is reported to UGCI. The
  * watchdog timer will trigger if we do not send a watchdog event for this
  * period. We actually attempt to send 2 refreshes per period. E.g. if the
- * timer is set for 60 seconds, we will refresh every 30 seconds. NOTE,
- * this requires you to poll with a timeout of a maximum of the refresh
- * rate (1/2 of the timer) for optimal usage. See section 4.1 of the HAPP
- * UGCI Spec. */
+ * timer is set for 60 seconds, we will refresh every 30 seconds. The
+ * refresh is driven by a timer in the same wait set as the devices, so
+ * ugci_poll() wakes up for it on its own, but you still need to be polling
+ * (or dispatching from ugci_get_fd()), unless ugci_start_watchdog() is
+ * used. See section 4.1 of the HAPP UGCI Spec. */
 int ugci_set_watchdog(int id, int type, unsigned short seconds);
 
 #define UGCI_WD_BOOT		1
 #define UGCI_WD_RUNTIME		2
 
+/* Refresh the runtime watchdogs from a thread of our own instead, so a
+ * game that stops polling (or hangs in a callback) still keeps its boards
+ * from resetting. If priority is above zero the thread is SCHED_FIFO at
+ * that priority, or at normal priority if we are not allowed. It sleeps
+ * until the next refresh is due, but wakes at least every 100ms to notice
+ * new watchdogs. How close each refresh came is in ugci_get_stats().
+ * Returns less than zero on error. */
+int ugci_start_watchdog(int priority);
+
+/* Stops the watchdog thread, and refreshes go back to ugci_poll(). This is
+ * done by ugci_close() as well. */
+void ugci_stop_watchdog(void);
+
 
 /* Keyboard boot mode. "mode" is one of the below settings. See section
  * 4.6 of the HAPP UGCI Spec. */
@@ -132,10 +453,125 @@ int ugci_kbd_mode(int id, int mode, unsigned char delay);
 #define UGCI_KBD_BOOT		2 /* Requires delay */
 
 
+/* Each of the above is a USB control transfer or two, and the watchdog
+ * refresh is normally sent from inside ugci_poll(), so a slow one holds up
+ * input. This starts a thread that sends them instead, from a queue on
+ * each board. With it running, watchdog refreshes are queued for it, and
+ * the ugci_queue_*() calls below can be used. A board only has room for
+ * one of each command. Queuing one that is already waiting replaces what
+ * it will send, so back to back refreshes go out as one. The calls above
+ * still send right away. Returns less than zero on error. */
+int ugci_start_writer(void);
+
+/* Sends whatever is still queued, then stops the writer thread. This is
+ * done by ugci_close() as well. */
+void ugci_stop_writer(void);
+
+enum ugci_command {
+	UGCI_CMD_WD_BOOT = 0,
+	UGCI_CMD_WD_RUNTIME,
+	UGCI_CMD_KBD_MODE,
+	UGCI_CMD_SECBLK,
+	UGCI_CMD_MAX, /* Final entry */
+};
+
+/* Called from the writer thread as each command is sent, with the device
+ * (not player) ID, and a status of zero, or less than zero if it failed.
+ * A command that was replaced while waiting is only reported once. The
+ * next command waits for this to return. */
+typedef void (*ugci_command_callback_t)(int id, enum ugci_command cmd, int status, void *data);
+
+void ugci_set_command_callback(ugci_command_callback_t cb, void *data);
+
+/* Queue the same thing as ugci_set_watchdog(), ugci_kbd_mode() or
+ * ugci_set_secblk() for the writer thread. Returns as soon as it is
+ * queued, or less than zero if there is no such device or the writer is
+ * not running. */
+int ugci_queue_watchdog(int id, int type, unsigned short seconds);
+int ugci_queue_kbd_mode(int id, int mode, unsigned char delay);
+int ugci_queue_secblk(int id, unsigned char values[UGCI_SEC_VALUES]);
+
+
 /* Get the contents of the eeprom. data must be able to hold atleast 504
- * bytes. The actual length of data is returned in *len. */
+ * bytes. The actual length of data is returned in *len. The eeprom is not
+ * read by ugci_init(), so the first call for each board blocks while it
+ * is transferred, unless ugci_load_eeproms() got to it first. */
 int ugci_get_eeprom(int id, unsigned char *data, int *len);
 
+/* Read every board's eeprom on a background thread, so ugci_get_eeprom()
+ * does not have to wait for it later. Returns right away, or less than
+ * zero if the thread could not be started. */
+int ugci_load_eeproms(void);
+
+/* Whether a board's eeprom has been read yet. Never blocks, even while the
+ * eeprom is being read. Returns one of the below, or less than zero if
+ * there is no such device. */
+int ugci_eeprom_status(int id);
+
+#define UGCI_EEPROM_UNREAD	0
+#define UGCI_EEPROM_READY	1
+#define UGCI_EEPROM_FAILED	2
+
+
+/* Independent library instances. Everything above works on a default
+ * context that is created on first use. Each ugci_ctx_*() call below does
+ * the same as its ugci_*() counterpart, but on its own set of boards,
+ * callback and event queue, so several subsystems (or several sets of
+ * boards) can use the library in the same process without stepping on
+ * each other.
+ *
+ * All calls are safe from multiple threads. Device calls (secblk,
+ * watchdog, etc) take a per-device lock, and polling takes a per-context
+ * lock, so one thread can be polling while another sets the watchdog.
+ * The writer thread only takes a lock of its own on each board, so even
+ * that does not wait on it.
+ * The callback runs with the polling lock held, so it must not poll the
+ * same context. Do not close or free a context while another thread is
+ * still using it. ugci_sim_config() and ugci_replay_config() are shared by
+ * every context. */
+struct ugci_ctx;
+
+struct ugci_ctx *ugci_ctx_new(void);
+void ugci_ctx_free(struct ugci_ctx *ctx);
+
+int ugci_ctx_set_backend(struct ugci_ctx *ctx, int type);
+int ugci_ctx_set_cache(struct ugci_ctx *ctx, const char *path);
+int ugci_ctx_set_read_buffer(struct ugci_ctx *ctx, int urefs, int budget);
+int ugci_ctx_init(struct ugci_ctx *ctx, ugci_callback_t cb, unsigned int mask, int info);
+void ugci_ctx_set_event_callback(struct ugci_ctx *ctx, ugci_event_callback_t cb, void *data);
+void ugci_ctx_close(struct ugci_ctx *ctx);
+int ugci_ctx_poll(struct ugci_ctx *ctx, int timeout);
+int ugci_ctx_poll_events(struct ugci_ctx *ctx, struct ugci_event *out, int max, int timeout);
+int ugci_ctx_start_reader(struct ugci_ctx *ctx, int ring_size);
+void ugci_ctx_stop_reader(struct ugci_ctx *ctx);
+int ugci_ctx_get_reader_stats(struct ugci_ctx *ctx, int id, struct ugci_reader_stats *stats);
+int ugci_ctx_set_low_latency(struct ugci_ctx *ctx, int priority, int cpu, int spin_us);
+int ugci_ctx_get_stats(struct ugci_ctx *ctx, int id, struct ugci_stats *stats);
+int ugci_ctx_record(struct ugci_ctx *ctx, const char *path);
+int ugci_ctx_publish(struct ugci_ctx *ctx, const char *name, int size);
+int ugci_ctx_get_fd(struct ugci_ctx *ctx);
+int ugci_ctx_dispatch(struct ugci_ctx *ctx);
+int ugci_ctx_enable_hotplug(struct ugci_ctx *ctx);
+int ugci_ctx_get_coin_count(struct ugci_ctx *ctx, int id, unsigned short *count);
+int ugci_ctx_get_snapshot(struct ugci_ctx *ctx, int id, struct ugci_board_state *state);
+int ugci_ctx_get_state(struct ugci_ctx *ctx, struct ugci_player_state *out, int max);
+void ugci_ctx_set_coin_simulate(struct ugci_ctx *ctx, int wait_time);
+int ugci_ctx_set_secblk(struct ugci_ctx *ctx, int id, unsigned char values[UGCI_SEC_VALUES]);
+int ugci_ctx_get_secblk(struct ugci_ctx *ctx, int id, unsigned char values[UGCI_SEC_VALUES]);
+int ugci_ctx_set_watchdog(struct ugci_ctx *ctx, int id, int type, unsigned short seconds);
+int ugci_ctx_kbd_mode(struct ugci_ctx *ctx, int id, int mode, unsigned char delay);
+int ugci_ctx_start_watchdog(struct ugci_ctx *ctx, int priority);
+void ugci_ctx_stop_watchdog(struct ugci_ctx *ctx);
+int ugci_ctx_start_writer(struct ugci_ctx *ctx);
+void ugci_ctx_stop_writer(struct ugci_ctx *ctx);
+void ugci_ctx_set_command_callback(struct ugci_ctx *ctx, ugci_command_callback_t cb, void *data);
+int ugci_ctx_queue_watchdog(struct ugci_ctx *ctx, int id, int type, unsigned short seconds);
+int ugci_ctx_queue_kbd_mode(struct ugci_ctx *ctx, int id, int mode, unsigned char delay);
+int ugci_ctx_queue_secblk(struct ugci_ctx *ctx, int id, unsigned char values[UGCI_SEC_VALUES]);
+int ugci_ctx_get_eeprom(struct ugci_ctx *ctx, int id, unsigned char *data, int *len);
+int ugci_ctx_load_eeproms(struct ugci_ctx *ctx);
+int ugci_ctx_eeprom_status(struct ugci_ctx *ctx, int id);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,424 @@
+/*
+ * Copyright (C) 2006 Ben Collins <bcollins@ubuntu.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+
+#include "ugci.h"
+
+static unsigned long long events;
+static unsigned long long lat_total, lat_worst;
+
+/* The simulated boards tick on whole multiples of this, so the time since
+ * the last tick is how long an event took to get to us, as long as that
+ * is less than one period. 0 when replaying. */
+static unsigned long long tick_period;
+
+/* 100ns buckets up to 10ms, the last gets everything longer */
+#define TICK_BUCKETS	100000
+static unsigned long long tick_hist[TICK_BUCKETS + 1];
+
+/* Stop as soon as a poll comes back empty, for a replay that has run
+ * out. Only used when replaying as fast as possible. */
+static int until_idle;
+
+static unsigned long long clock_ns(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned long long now_ns(void)
+{
+	return clock_ns(CLOCK_MONOTONIC);
+}
+
+/* From the read() to the application getting it */
+static void latency(const struct ugci_event *ev, unsigned long long now)
+{
+	unsigned long long lat = now > ev->time ? now - ev->time : 0;
+
+	lat_total += lat;
+	if (lat > lat_worst)
+		lat_worst = lat;
+
+	if (tick_period) {
+		lat = (now % tick_period) / 100;
+		tick_hist[lat < TICK_BUCKETS ? lat : TICK_BUCKETS]++;
+	}
+}
+
+/* In us, from the top of its bucket */
+static double tick_percentile(double p)
+{
+	unsigned long long total = 0, want, seen = 0;
+	int i;
+
+	for (i = 0; i <= TICK_BUCKETS; i++)
+		total += tick_hist[i];
+
+	want = total * p;
+	for (i = 0; i < TICK_BUCKETS; i++) {
+		if ((seen += tick_hist[i]) > want)
+			break;
+	}
+
+	return (i + 1) * 100 / 1e3;
+}
+
+static void mycallback(const struct ugci_event *ev, void *data)
+{
+	events++;
+	latency(ev, now_ns());
+}
+
+struct bench {
+	unsigned long long events;
+	unsigned long long polls;
+	unsigned long long busy;
+	unsigned long long worst;
+	unsigned long long elapsed;
+	unsigned long long cpu;		/* All threads, so the reader too */
+	unsigned long long lat_total;
+	unsigned long long lat_worst;
+};
+
+static void usage(int exitval) __attribute__((__noreturn__));
+static void usage(int exitval)
+{
+	fprintf(exitval ? stderr : stdout, "Usage: ugcibench [--help] [--boards n] "
+		"[--rate events/sec] [--seconds n] [--simul ms] [--batch]\n"
+		"                 [--reader ring_size] [--sweep] [--record file]\n"
+		"                 [--replay file [--realtime]]\n"
+		"                 [--watchdog seconds [--writer] [--wd-thread priority]]\n"
+		"                 [--fifo priority] [--cpu n] [--spin us]\n");
+	exit(exitval);
+}
+
+static int run(struct ugci_ctx *ctx, int seconds, int batch, struct bench *b)
+{
+	unsigned long long start, end, t, cpu;
+	int n;
+
+	memset(b, 0, sizeof(*b));
+	events = lat_total = lat_worst = 0;
+
+	cpu = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+	start = now_ns();
+	end = start + (unsigned long long)seconds * 1000000000ULL;
+
+	while ((t = now_ns()) < end) {
+		unsigned long long took;
+
+		if (batch) {
+			struct ugci_event ev[256];
+			unsigned long long now;
+			int i;
+
+			n = ugci_ctx_poll_events(ctx, ev, 256, 100);
+			now = now_ns();
+
+			if (n < 0)
+				return -1;
+			events += n;
+
+			for (i = 0; i < n; i++)
+				latency(&ev[i], now);
+			if (!n && until_idle)
+				break;
+		} else if ((n = ugci_ctx_poll(ctx, 100)) < 0) {
+			return -1;
+		} else if (!n && until_idle) {
+			break;
+		}
+
+		/* Includes the wait, which is near zero once the rate is
+		 * high enough to always have something pending */
+		took = now_ns() - t;
+		b->polls++;
+		b->busy += took;
+		if (took > b->worst)
+			b->worst = took;
+	}
+
+	b->elapsed = now_ns() - start;
+	b->cpu = clock_ns(CLOCK_PROCESS_CPUTIME_ID) - cpu;
+	b->events = events;
+	b->lat_total = lat_total;
+	b->lat_worst = lat_worst;
+
+	return 0;
+}
+
+/* Same total rate spread over more and more boards. With only the ready
+ * boards being looked at, the cost per event should stay flat. */
+static void sweep(unsigned int rate, int seconds, int batch, int reader)
+{
+	static const int boards[] = { 1, 4, 16, 64, 128, 256 };
+	struct bench b;
+	int i, rd;
+
+	printf("%6s %12s %12s %10s %14s\n", "boards", "events/sec",
+	       "events/poll", "us/poll", "cpu ns/event");
+
+	for (i = 0; i < sizeof(boards) / sizeof(boards[0]); i++) {
+		struct ugci_ctx *ctx = ugci_ctx_new();
+
+		if (!ctx)
+			break;
+
+		ugci_ctx_set_backend(ctx, UGCI_BACKEND_SIM);
+		ugci_sim_config(boards[i], rate / boards[i] ?: 1);
+
+		ugci_ctx_set_event_callback(ctx, mycallback, NULL);
+		rd = ugci_ctx_init(ctx, NULL, UGCI_EVENT_MASK_COIN |
+				   UGCI_EVENT_MASK_PLAY, 0);
+		if (rd != boards[i]) {
+			fprintf(stderr, "Only got %d of %d boards\n", rd, boards[i]);
+			ugci_ctx_free(ctx);
+			break;
+		}
+
+		if ((reader && ugci_ctx_start_reader(ctx, reader)) ||
+		    run(ctx, seconds, batch, &b)) {
+			fprintf(stderr, "Benchmark failed for %d boards\n", boards[i]);
+			ugci_ctx_free(ctx);
+			break;
+		}
+
+		printf("%6d %12.0f %12.1f %10.2f %14.0f\n", boards[i],
+		       b.events / (b.elapsed / 1e9),
+		       b.polls ? (double)b.events / b.polls : 0.0,
+		       b.polls ? b.busy / 1e3 / b.polls : 0.0,
+		       b.events ? (double)b.cpu / b.events : 0.0);
+
+		ugci_ctx_free(ctx);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	int i, rd, boards = 1, seconds = 5, simul = 0, batch = 0, reader = 0;
+	int do_sweep = 0, realtime = 0, watchdog = 0, writer = 0, wd_thread = -1;
+	int fifo = 0, cpu = -1, spin = 0;
+	char *record = NULL, *replay = NULL;
+	unsigned int rate = 10000;
+	struct ugci_ctx *ctx;
+	struct bench b;
+
+	while (1) {
+		int c;
+		static struct option long_options[] = {
+			{"help",	0, NULL, 'h'},
+			{"boards",	1, NULL, 'b'},
+			{"rate",	1, NULL, 'r'},
+			{"seconds",	1, NULL, 's'},
+			{"simul",	1, NULL, 'S'},
+			{"batch",	0, NULL, 'B'},
+			{"reader",	1, NULL, 'R'},
+			{"sweep",	0, NULL, 'w'},
+			{"record",	1, NULL, 'o'},
+			{"replay",	1, NULL, 'p'},
+			{"realtime",	0, NULL, 't'},
+			{"watchdog",	1, NULL, 'd'},
+			{"writer",	0, NULL, 'W'},
+			{"wd-thread",	1, NULL, 'T'},
+			{"fifo",	1, NULL, 'f'},
+			{"cpu",		1, NULL, 'c'},
+			{"spin",	1, NULL, 'y'},
+			{ 0 },
+		};
+
+		c = getopt_long(argc, argv, "hb:r:s:S:BR:wo:p:td:WT:f:c:y:", long_options, NULL);
+		if (c == -1)
+			break;
+
+		switch (c) {
+			case 'h':
+				usage(0);
+				break;
+			case 'b':
+				boards = atoi(optarg);
+				break;
+			case 'r':
+				rate = strtoul(optarg, NULL, 0);
+				break;
+			case 's':
+				seconds = atoi(optarg);
+				break;
+			case 'S':
+				simul = atoi(optarg);
+				break;
+			case 'B':
+				batch = 1;
+				break;
+			case 'R':
+				reader = atoi(optarg);
+				break;
+			case 'w':
+				do_sweep = 1;
+				break;
+			case 'o':
+				record = optarg;
+				break;
+			case 'p':
+				replay = optarg;
+				break;
+			case 't':
+				realtime = 1;
+				break;
+			case 'd':
+				watchdog = atoi(optarg);
+				break;
+			case 'W':
+				writer = 1;
+				break;
+			case 'T':
+				wd_thread = atoi(optarg);
+				break;
+			case 'f':
+				fifo = atoi(optarg);
+				break;
+			case 'c':
+				cpu = atoi(optarg);
+				break;
+			case 'y':
+				spin = atoi(optarg);
+				break;
+			default:
+				usage(1);
+		}
+	}
+
+	if (argc != optind)
+		usage(1);
+
+	if (do_sweep) {
+		sweep(rate, seconds, batch, reader);
+		exit(0);
+	}
+
+	if (!(ctx = ugci_ctx_new()))
+		exit(1);
+
+	if (replay) {
+		ugci_ctx_set_backend(ctx, UGCI_BACKEND_REPLAY);
+		ugci_replay_config(replay, realtime);
+		until_idle = !realtime;
+	} else {
+		ugci_ctx_set_backend(ctx, UGCI_BACKEND_SIM);
+		ugci_sim_config(boards, rate);
+		if (rate)
+			tick_period = 1000000000ULL / rate;
+		if (tick_period && tick_period < 10000)
+			tick_period = 10000;
+	}
+
+	ugci_ctx_set_event_callback(ctx, mycallback, NULL);
+	rd = ugci_ctx_init(ctx, NULL, UGCI_EVENT_MASK_COIN | UGCI_EVENT_MASK_PLAY, 1);
+
+	printf("Detected %d UGCI device%s\n", rd, rd == 1 ? "" : "s");
+
+	if (rd <= 0)
+		exit(1);
+
+	ugci_ctx_set_coin_simulate(ctx, simul);
+
+	if (reader && ugci_ctx_start_reader(ctx, reader)) {
+		fprintf(stderr, "Could not start reader thread\n");
+		exit(1);
+	}
+
+	/* The reader thread if there is one, otherwise this one, which polls */
+	if ((fifo || cpu >= 0 || spin) &&
+	    ugci_ctx_set_low_latency(ctx, fifo, cpu, spin))
+		fprintf(stderr, "Could not set up all of low-latency mode\n");
+
+	if (writer && ugci_ctx_start_writer(ctx)) {
+		fprintf(stderr, "Could not start writer thread\n");
+		exit(1);
+	}
+
+	if (wd_thread >= 0 && ugci_ctx_start_watchdog(ctx, wd_thread)) {
+		fprintf(stderr, "Could not start watchdog thread\n");
+		exit(1);
+	}
+
+	for (i = 0; watchdog && i < rd; i++)
+		ugci_ctx_set_watchdog(ctx, i, UGCI_WD_RUNTIME, watchdog);
+
+	if (record && ugci_ctx_record(ctx, record)) {
+		perror(record);
+		exit(1);
+	}
+
+	run(ctx, seconds, batch, &b);
+
+	/* Stop it before the stats, so they match what was written */
+	if (record)
+		ugci_ctx_record(ctx, NULL);
+
+	printf("\n%llu events in %.3f seconds: %.0f events/sec\n", b.events,
+	       b.elapsed / 1e9, b.events / (b.elapsed / 1e9));
+	printf("%llu polls, %.1f events/poll, %.2f us/poll (worst %.2f us)\n",
+	       b.polls, b.polls ? (double)b.events / b.polls : 0.0,
+	       b.polls ? b.busy / 1e3 / b.polls : 0.0, b.worst / 1e3);
+	printf("%.0f ns of CPU per event\n", b.events ? (double)b.cpu / b.events : 0.0);
+	printf("Read to delivery: %.2f us average, %.2f us worst\n",
+	       b.events ? b.lat_total / 1e3 / b.events : 0.0, b.lat_worst / 1e3);
+	if (tick_period)
+		printf("Tick to delivery: %.2f us p50, %.2f us p99, %.2f us p999\n",
+		       tick_percentile(0.5), tick_percentile(0.99),
+		       tick_percentile(0.999));
+
+	for (i = 0; i < rd; i++) {
+		struct ugci_stats st;
+
+		if (ugci_ctx_get_stats(ctx, i, &st))
+			continue;
+		printf("Device %d: %llu reads, %.1f bytes/read, %llu full, "
+		       "%llu filtered, %llu forced releases\n", i, st.reads,
+		       st.reads ? (double)st.bytes / st.reads : 0.0,
+		       st.full_reads, st.filtered, st.forced_releases);
+		if (watchdog)
+			printf("Device %d: %llu watchdog refreshes, %llu queued commands "
+			       "(%llu coalesced)\n", i, st.wd_refreshes, st.commands,
+			       st.coalesced);
+		if (watchdog && st.wd_min_slack)
+			printf("Device %d: %llu watchdog refreshes late, closest "
+			       "%.3f ms before the deadline\n", i, st.wd_missed,
+			       st.wd_min_slack / 1e6);
+	}
+
+	for (i = 0; reader && i < rd; i++) {
+		struct ugci_reader_stats st;
+
+		if (ugci_ctx_get_reader_stats(ctx, i, &st))
+			continue;
+		printf("Ring %d: %llu events, %llu overflows, high water %u/%u\n",
+		       i, st.events, st.overflows, st.high_water, st.size);
+	}
+
+	ugci_ctx_free(ctx);
+
+	exit(0);
+}
@@ -0,0 +1,134 @@
+/*
+ * Copyright (C) 2006 Ben Collins <bcollins@ubuntu.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Owns the boards and publishes their events for any number of other
+ * processes, see ugci_publish(). Anything built against libugci that
+ * does not pick a backend gets its events from here while this runs. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <getopt.h>
+
+#include "ugci.h"
+
+static volatile sig_atomic_t stop;
+
+static void handle_stop(int sig)
+{
+	stop = 1;
+}
+
+static void usage(int exitval) __attribute__((__noreturn__));
+static void usage(int exitval)
+{
+	fprintf(exitval ? stderr : stdout, "Usage: ugcid [--help] [--name name] "
+		"[--size events] [--simul ms] [--hidraw]\n"
+		"             [--sim boards [--rate events/sec]]\n");
+	exit(exitval);
+}
+
+int main(int argc, char *argv[])
+{
+	int rd, size = 0, simul = 0, sim = 0, backend = UGCI_BACKEND_HIDDEV;
+	const char *name = UGCI_BUS_NAME;
+	unsigned int rate = 10;
+	struct ugci_event ev[256];
+	struct sigaction sa;
+
+	while (1) {
+		int c;
+		static struct option long_options[] = {
+			{"help",	0, NULL, 'h'},
+			{"name",	1, NULL, 'n'},
+			{"size",	1, NULL, 's'},
+			{"simul",	1, NULL, 'S'},
+			{"hidraw",	0, NULL, 'x'},
+			{"sim",		1, NULL, 'b'},
+			{"rate",	1, NULL, 'r'},
+			{ 0 },
+		};
+
+		c = getopt_long(argc, argv, "hn:s:S:xb:r:", long_options, NULL);
+		if (c == -1)
+			break;
+
+		switch (c) {
+			case 'h':
+				usage(0);
+				break;
+			case 'n':
+				name = optarg;
+				break;
+			case 's':
+				size = atoi(optarg);
+				break;
+			case 'S':
+				simul = atoi(optarg);
+				break;
+			case 'x':
+				backend = UGCI_BACKEND_HIDRAW;
+				break;
+			case 'b':
+				sim = atoi(optarg);
+				backend = UGCI_BACKEND_SIM;
+				break;
+			case 'r':
+				rate = strtoul(optarg, NULL, 0);
+				break;
+			default:
+				usage(1);
+		}
+	}
+
+	if (argc != optind)
+		usage(1);
+
+	/* Always set, or we would find ourselves */
+	ugci_set_backend(backend);
+	if (sim)
+		ugci_sim_config(sim, rate);
+
+	/* Everything, since each reader has its own mask */
+	rd = ugci_init(NULL, UGCI_EVENT_MASK_COIN | UGCI_EVENT_MASK_PLAY |
+		       UGCI_EVENT_MASK_DEVICE | UGCI_EVENT_MASK_AXIS |
+		       UGCI_EVENT_MASK_BUTTON, 1);
+	if (rd < 0)
+		exit(1);
+
+	ugci_set_coin_simulate(simul);
+	ugci_enable_hotplug();
+
+	if (ugci_publish(name, size)) {
+		fprintf(stderr, "Could not publish events on %s\n", name);
+		exit(1);
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = handle_stop;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	/* The signal interrupts the wait, or we see it within a second */
+	while (! stop && ugci_poll_events(ev, 256, 1000) >= 0)
+		/* Nothing to do, ugci_publish() has them */;
+
+	ugci_close();
+
+	exit(0);
+}
@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2006 Ben Collins <bcollins@ubuntu.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Pulls the last simulated board out from under a consumer that is
+ * waiting forever, with and without the reader thread. It has to get the
+ * removal event and then an error, not hang. Run by "make check". */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "ugci.h"
+
+static void *unplug(void *arg)
+{
+	usleep(200000);
+	if (ugci_sim_unplug(0))
+		fprintf(stderr, "Could not unplug the board\n");
+	return NULL;
+}
+
+static int check(int reader)
+{
+	struct ugci_ctx *ctx = ugci_ctx_new();
+	struct ugci_event ev[16];
+	int n, i, removed = 0;
+	pthread_t thread;
+
+	ugci_ctx_set_backend(ctx, UGCI_BACKEND_SIM);
+
+	if (ugci_ctx_init(ctx, NULL, UGCI_EVENT_MASK_DEVICE, 0) != 1 ||
+	    (reader && ugci_ctx_start_reader(ctx, 64))) {
+		fprintf(stderr, "Could not set up the simulated board\n");
+		return 1;
+	}
+
+	pthread_create(&thread, NULL, unplug, NULL);
+
+	while ((n = ugci_ctx_poll_events(ctx, ev, 16, -1)) >= 0) {
+		for (i = 0; i < n; i++) {
+			if (ev[i].type == UGCI_EVENT_DEVICE && !ev[i].value)
+				removed++;
+		}
+	}
+
+	pthread_join(thread, NULL);
+	ugci_ctx_close(ctx);
+	ugci_ctx_free(ctx);
+
+	printf("%s reader thread: %d removal event%s\n", reader ? "With" : "Without",
+	       removed, removed == 1 ? "" : "s");
+
+	return removed != 1;
+}
+
+int main(int argc, char *argv[])
+{
+	int failed;
+
+	/* A hang is a failure too */
+	alarm(10);
+
+	ugci_sim_config(1, 0);
+
+	failed = check(0);
+	failed |= check(1);
+
+	exit(failed);
+}
@@ -62,14 +62,19 @@ int main(int argc, char *argv[])
 
 	interval = atoi(argv[optind]);
 
+	ugci_set_backend(UGCI_BACKEND_HIDDEV);
+
 	rd = ugci_init(NULL, UGCI_EVENT_WD, 1);
 
 	printf("Detected %d UGCI device%s\n", rd, rd == 1 ? "" : "s");
 
-	if (!rd)
-		exit(0);
+	if (rd <= 0)
+		exit(rd ? 1 : 0);
 
-	ugci_set_watchdog(id, UGCI_WD_RUNTIME, interval);
+	if (ugci_set_watchdog(id, UGCI_WD_RUNTIME, interval)) {
+		fprintf(stderr, "UGCI(%d): Could not set the watchdog\n", id);
+		exit(1);
+	}
 
 	while (ugci_poll(1000) >= 0)
 		; //printf("Polling...\n");